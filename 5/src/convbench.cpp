@@ -0,0 +1,125 @@
+/* 2014
+ * Maciej Szeptuch
+ * II UWr
+ */
+#include "defines.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+#include "libs/logger/logger.h"
+
+using namespace std;
+
+#include "hgt/file.h"
+#include "hgt/convert.h"
+
+using namespace terrain;
+
+Log     debug;
+Logger  logger(debug, "CONVBENCH");
+
+double measure(hgt::Converter kernel, int16_t *dst, const int16_t *src, size_t count, int rounds);
+double measureCopy(int16_t *dst, const int16_t *src, size_t count, int rounds);
+
+// Conversion kernels over buffers already faulted in and warmed up: one
+// that fits the caches, and maps' worth that has to stream from memory,
+// against a plain copy of the same bytes
+int main(int argc, char **argv)
+{
+    debug.setLevel(Log::DEBUG);
+
+    int maps    = 16;
+    int rounds  = 10;
+    for(int opt = 0; (opt = getopt(argc, argv, "m:r:")) != -1; )
+        switch(opt)
+        {
+            case 'm':
+                maps = max(1, atoi(optarg));
+                break;
+
+            case 'r':
+                rounds = max(1, atoi(optarg));
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-m maps] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+
+    struct Kernel
+    {
+        const char      *name;
+        hgt::Converter  kernel;
+        bool            supported;
+    } kernels[] = {
+        {"scalar",  hgt::convertScalar, true},
+#ifdef HGT_CONVERT_X86
+        {"SSE2",    hgt::convertSSE2,   __builtin_cpu_supports("sse2") != 0},
+        {"AVX2",    hgt::convertAVX2,   __builtin_cpu_supports("avx2") != 0},
+#endif // HGT_CONVERT_X86
+    };
+
+    const size_t sizes[] = {16384, (size_t) maps * hgt::SAMPLES * hgt::SAMPLES};
+    for(size_t count: sizes)
+    {
+        vector<int16_t> src(count);
+        vector<int16_t> dst(count);
+        vector<int16_t> expected(count);
+        for(size_t s = 0; s < count; ++ s)
+            src[s] = s % 997 ? rand() : -32768;
+
+        hgt::convertScalar(expected.data(), src.data(), count);
+        const double copy = measureCopy(dst.data(), src.data(), count, rounds);
+        logger.info("%zu samples (%.2lf MB), copy: %.2lf GB/s", count, count * sizeof(int16_t) / 1048576.0, copy);
+        for(const Kernel &kernel: kernels)
+        {
+            if(!kernel.supported)
+            {
+                logger.info("  %s: not supported", kernel.name);
+                continue;
+            }
+
+            const double rate = measure(kernel.kernel, dst.data(), src.data(), count, rounds);
+            const bool valid = equal(dst.begin(), dst.end(), expected.begin());
+            logger.info("  %s: %.2lf GB/s, %.1lf%% of copy%s", kernel.name, rate, 100.0 * rate / copy, valid ? "" : ", WRONG RESULT");
+        }
+    }
+
+    return 0;
+}
+
+// Best of the rounds, bytes read and written per second
+double measure(hgt::Converter kernel, int16_t *dst, const int16_t *src, size_t count, int rounds)
+{
+    kernel(dst, src, count);
+
+    double best = 1e9;
+    for(int r = 0; r < rounds; ++ r)
+    {
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        kernel(dst, src, count);
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+
+    return 2.0 * count * sizeof(int16_t) / best / 1e9;
+}
+
+double measureCopy(int16_t *dst, const int16_t *src, size_t count, int rounds)
+{
+    memcpy(dst, src, count * sizeof(int16_t));
+
+    double best = 1e9;
+    for(int r = 0; r < rounds; ++ r)
+    {
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        memcpy(dst, src, count * sizeof(int16_t));
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+
+    return 2.0 * count * sizeof(int16_t) / best / 1e9;
+}
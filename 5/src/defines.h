@@ -0,0 +1,50 @@
+#ifndef __DEFINES_H__
+#define __DEFINES_H__
+
+// GLM
+#define GLM_FORCE_RADIANS   true
+
+// LIBS OPTS
+#define INLINE_BUILD        true
+
+// DETAIL SETTINGS
+#define DETAIL_LEVELS       10
+#define MERCATOR_BOUNDS     20480000.0
+#define TWO_POWER           17
+#define FIVE_POWER          5
+
+// MAP RESIDENCY
+#define WORLD_MEMORY_BUDGET 2048
+
+// TILE CACHE (MB OF GPU MEMORY)
+#define TILE_CACHE_BUDGET   256
+
+// ADAPTIVE TILE MESHES (MAX ERROR IN METERS AT THE FINEST LEVEL, 0 FOR REGULAR GRIDS)
+#define MESH_ERROR          5.0
+
+// PREFETCH (SECONDS AHEAD, TILES PER IDLE LOADER FRAME)
+#define PREFETCH_AHEAD      0.5
+#define PREFETCH_TILES      3
+
+// GEOMETRY CLIPMAP (LEVELS, LEVELS DRAWN, VERTICES A SIDE, FINEST SPACING IN METERS)
+#define CLIPMAP_LEVELS      16
+#define CLIPMAP_ACTIVE      6
+#define CLIPMAP_SIZE        129
+#define CLIPMAP_SPACING     64.0
+
+// FPS CONFIG
+#define LOADER_FPS          60
+#define DRAWER_FPS          60
+#define MOVEMENT_FPS        60
+
+// GLFW HELPERS
+#define DECL_GLFW_CALLBACK(ext, fn)                 \
+    template<typename... Types>                     \
+    static void __glfw_cb_ ## fn(Types... values)   \
+    {                                               \
+        ::ext.fn(values...);                        \
+    }
+
+#define GLFW_CALLBACK(fn) __glfw_cb_ ## fn
+
+#endif // __DEFINES_H__
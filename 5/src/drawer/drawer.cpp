@@ -4,18 +4,29 @@
 #include <chrono>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include "engine/engine.h"
 #include "engine/objects.h"
+#include "projection/mercator.h"
 #include "libs/logger/logger.h"
 
 using namespace std;
 using namespace terrain;
 using namespace terrain::drawer;
+using namespace terrain::projection;
 
 Drawer::Drawer(Log &_log, engine::Engine &_engine)
 :log(_log, "DRAWER")
 ,engine(_engine)
+,layers(0)
+,budget(BUDGET_INITIAL)
+,center(0)
+,timed(false)
+,timers()
+,timer(0)
+,gpuTime(0.0)
+,triangles(0)
 {
 }
 
@@ -33,7 +44,11 @@ void Drawer::start(void)
     loadPrograms();
     generateTile();
     generateGrid();
+    generateClipmap();
 
+    // Loader starts filling layers once they exist in its shared context
+    glFlush();
+    engine.local.layers = layers;
     log.notice("Started drawer");
 }
 
@@ -41,21 +56,24 @@ void Drawer::run(void)
 {
     log.debug("Running drawer");
 
-    uint8_t adaptive    = 0;
     uint8_t lod         = 0;
-    uint16_t fast       = 0;
 
     double  lastFrame   = 0;
     double  fps         = 0;
+    uint32_t culled     = 0;
     for(uint16_t c = 0; state == Thread::STARTED; ++ c)
     {
         engine.updateViewport();
         lastFrame = glfwGetTime();
-        lod = engine.options.lod ? (engine.options.lod - 1) * 10 : adaptive;
+        updateBudget();
+        lod = engine.options.lod ? (engine.options.lod - 1) * 10 : center * 10;
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        beginTimer();
         drawGrid(lod / 10);
-        drawTerrain(lod);
+        if(engine.options.viewType != engine::VIEW_3D || !engine.options.clipmap || !drawClipmap())
+            culled += drawTerrain(lod);
+        endTimer();
         glfwSwapBuffers(engine.gl.window);
 
         const double    currentFrame    = glfwGetTime();
@@ -65,26 +83,11 @@ void Drawer::run(void)
         // FRAMES COUNTER
         if(fps >= 2.0 || c >= 240)
         {
-            log.debug("Current FPS: %.3lf", c / fps);
+            log.debug("Current FPS: %.3lf, culled tiles per frame: %.2lf, tile triangles per frame: %.0lf, GPU time: %.2lfms, error budget: %.2fpx",
+                c / fps, c ? 1.0 * culled / c : 0.0, c ? 1.0 * triangles / c : 0.0, gpuTime * 1000.0, budget);
             c = fps = 0;
-        }
-
-        // ADAPTIVE LOD
-        if(!engine.options.lod)
-        {
-            if(diff <= 1.0 / DRAWER_FPS && ++ fast >= DRAWER_FPS)
-            {
-                fast = 0;
-                adaptive = max(0, adaptive - 1);
-                log.debug("ADAPTIVE-: %d", adaptive);
-            }
-
-            else if(diff > 1.0 / DRAWER_FPS)
-            {
-                fast = 0;
-                adaptive = min(adaptive + 1, DETAIL_LEVELS * 10);
-                log.debug("ADAPTIVE+: %d", adaptive);
-            }
+            culled = 0;
+            triangles = 0;
         }
 
         // FRAMES LIMIT (~60fps)
@@ -121,15 +124,69 @@ void Drawer::setupGL(void)
     glfwSwapInterval(0);
     // GL
     //// INDICES
-    glGenBuffers(DETAIL_LEVELS, engine.gl.gridIndice);
     glGenBuffers(DETAIL_LEVELS, engine.gl.tileIndice);
-    glGenBuffers(19, engine.gl.buffer);
+    glGenBuffers(engine::CLIPMAP_FULL + 1, engine.gl.clipmapIndice);
+    glGenBuffers(4, engine.gl.buffer);
     for(int t = 0; t < 9; ++ t)
     {
         engine.local.tile[t].order = t;
-        engine.local.tile[t].buffer = engine.gl.buffer[t];
+        engine.local.tile[t].layer = engine::TILE_LAYER_1 + t;
     }
 
+    glBindBuffer(GL_UNIFORM_BUFFER, engine.gl.buffer[engine::INSTANCE_BUFFER]);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(Instance) * 9, nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, engine.gl.buffer[engine::INSTANCE_BUFFER]);
+
+    //// TEXTURES
+    // Tiles in view and swap slots, the cache gets the rest of its budget
+    const uint32_t  density = (1 << DETAIL_LEVELS) + 1;
+    const uint64_t  bytes   = (uint64_t) density * density * sizeof(objects::TerrainPoint);
+    GLint           limit   = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &limit);
+    layers = min<uint64_t>(limit, engine::SPARE_LAYER_1 + max<uint64_t>(1, (uint64_t) TILE_CACHE_BUDGET * 1048576 / bytes));
+    if(layers <= engine::SPARE_LAYER_1)
+        throwError("Not enough texture array layers for tiles");
+
+    log.debug("Allocating %u height layers (%.2lf MB)", layers, layers * bytes / 1048576.0);
+    engine.gl.meshIndice.resize(layers);
+    engine.local.meshFirst.assign(layers * DETAIL_LEVELS, 0);
+    engine.local.meshSize.assign(layers * DETAIL_LEVELS, 0);
+    glGenBuffers(layers, engine.gl.meshIndice.data());
+
+    glGenTextures(1, &engine.gl.heights);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, engine.gl.heights);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16UI, density, density, layers, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, nullptr);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenTextures(1, &engine.gl.trig);
+    glBindTexture(GL_TEXTURE_2D, engine.gl.trig);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, density, 9, 0, GL_RGBA, GL_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Clipmap levels, a layer and a trig row each
+    glGenTextures(1, &engine.gl.clipmapHeights);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, engine.gl.clipmapHeights);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16UI, CLIPMAP_SIZE, CLIPMAP_SIZE, CLIPMAP_LEVELS, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, nullptr);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenTextures(1, &engine.gl.clipmapTrig);
+    glBindTexture(GL_TEXTURE_2D, engine.gl.clipmapTrig);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, CLIPMAP_SIZE, CLIPMAP_LEVELS, 0, GL_RGBA, GL_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
     glEnable(GL_CULL_FACE);
     glEnable(GL_MULTISAMPLE);
     glEnable(GL_BLEND);
@@ -137,13 +194,35 @@ void Drawer::setupGL(void)
     glEnable(GL_DEPTH_TEST);
 
     glClearColor(0x2E / 255.0, 0x34 / 255.0, 0x36 / 255.0, 1.0);
+
+    //// TIMERS
+    timed = GLEW_ARB_timer_query;
+    if(timed)
+        glGenQueries(TIMERS, timers);
+
+    else
+        log.warning("No timer queries, error budget stays at %.2fpx", budget);
 }
 
+// One mesh for all tiles: the grid positions and a full grid of triangles
+// per level, heights come from the tile's layer
 inline
 void Drawer::generateTile(void)
 {
     log.debug("Creating %d levels of detail tables for tiles", DETAIL_LEVELS);
     const uint32_t density = (1 << DETAIL_LEVELS) + 1;
+    vector<uint16_t> grid(density * density * 2);
+    for(uint32_t h = 0; h < density; ++ h)
+        for(uint32_t w = 0; w < density; ++ w)
+        {
+            grid[(h * density + w) * 2]     = w;
+            grid[(h * density + w) * 2 + 1] = h;
+        }
+
+    glBindBuffer(GL_ARRAY_BUFFER, engine.gl.buffer[engine::TILE_BUFFER]);
+    glBufferData(GL_ARRAY_BUFFER, grid.size() * sizeof(uint16_t), grid.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
     for(int l = 0; l < DETAIL_LEVELS; ++ l)
     {
         const uint32_t  tileDensity = (1 << (DETAIL_LEVELS - l));
@@ -174,130 +253,601 @@ void Drawer::generateTile(void)
     }
 }
 
+// Grid lines are computed per fragment, a single quad covers them
 inline
 void Drawer::generateGrid(void)
 {
     log.debug("Creating background grid");
-    const uint32_t density = (1 << DETAIL_LEVELS) + 1;
+    const GLfloat quad[] = {-1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f};
+    glBindBuffer(GL_ARRAY_BUFFER, engine.gl.buffer[engine::GRID_BUFFER]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// One grid of CLIPMAP_SIZE vertices a side for all levels. The finest level
+// drawn is the full grid, the others leave a hole for the finer one, which is
+// half as wide and sits up to one cell off their centre in either direction.
+inline
+void Drawer::generateClipmap(void)
+{
+    const uint32_t size     = CLIPMAP_SIZE;
+    const uint32_t cells    = size - 1;
+    vector<uint16_t> grid(size * size * 2);
+    for(uint32_t h = 0; h < size; ++ h)
+        for(uint32_t w = 0; w < size; ++ w)
+        {
+            grid[(h * size + w) * 2]     = w;
+            grid[(h * size + w) * 2 + 1] = h;
+        }
+
+    glBindBuffer(GL_ARRAY_BUFFER, engine.gl.buffer[engine::CLIPMAP_BUFFER]);
+    glBufferData(GL_ARRAY_BUFFER, grid.size() * sizeof(uint16_t), grid.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    for(uint32_t r = engine::CLIPMAP_RING_1; r <= engine::CLIPMAP_FULL; ++ r)
     {
-        glBindBuffer(GL_ARRAY_BUFFER, engine.gl.buffer[engine::GRID_BUFFER]);
-        glBufferData(GL_ARRAY_BUFFER, density * density * sizeof(objects::Position), nullptr, GL_STATIC_DRAW);
-        objects::Position   *point = (objects::Position *) glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-        uint32_t p = 0;
-        for(uint16_t h = 0; h < density; ++ h)
-            for(uint16_t w = 0; w < density; ++ w)
+        const uint32_t  hole    = r < engine::CLIPMAP_FULL ? cells / 2 : 0;
+        const uint32_t  holeW   = cells / 4 + r % 3 - 1;
+        const uint32_t  holeH   = cells / 4 + r / 3 - 1;
+        vector<uint32_t> indice;
+        indice.reserve((cells * cells - hole * hole) * 6);
+        for(uint32_t h = 0; h < cells; ++ h)
+            for(uint32_t w = 0; w < cells; ++ w)
             {
-                point[p ++] = objects::Position(
-                    -MERCATOR_BOUNDS + w * MERCATOR_BOUNDS * 2.0 / (density - 1),
-                    -MERCATOR_BOUNDS + h * MERCATOR_BOUNDS * 2.0 / (density - 1),
-                    0.0);
+                if(w >= holeW && w < holeW + hole && h >= holeH && h < holeH + hole)
+                    continue;
+
+                uint32_t current    = size * h + w,
+                         next       = current + size;
+
+                indice.push_back(current + 1);
+                indice.push_back(next);
+                indice.push_back(current);
+
+                indice.push_back(next + 1);
+                indice.push_back(next);
+                indice.push_back(current + 1);
             }
 
-        assert(p == density * density);
-        glUnmapBuffer(GL_ARRAY_BUFFER);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        engine.local.clipmapSize[r] = indice.size();
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, engine.gl.clipmapIndice[r]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indice.size() * sizeof(uint32_t), indice.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     }
 
-    log.debug("Creating %d levels of detail tables for grid", DETAIL_LEVELS);
-    for(int l = 0; l < DETAIL_LEVELS; ++ l)
+    log.debug("Creating clipmap of %d levels, %u triangles per frame", CLIPMAP_LEVELS,
+        (engine.local.clipmapSize[engine::CLIPMAP_FULL] + (CLIPMAP_ACTIVE - 1) * engine.local.clipmapSize[engine::CLIPMAP_RING_1]) / 3);
+}
+
+inline
+uint8_t Drawer::drawTerrain(int lod)
+{
+    const int LOD[9] = {3, 7, 2, 4, 8, 6, 0, 5, 1};
+    uint8_t culled = 0;
+    lock_guard<mutex> _lock(engine.local.tileLock);
+
+    // Fixed LOD: peripheral tiles one level coarser, coarse tiles no finer than
+    // their samples. Otherwise by screen space error, empty tiles have none.
+    // Raster tiles are sampled about a cell per pixel.
+    const bool raster = engine.options.viewType == engine::VIEW_2D && engine.options.raster;
+    uint8_t level[9];
+    for(uint8_t t = 0; t < 9; ++ t)
     {
-        const uint32_t  gridDensity = (1 << (DETAIL_LEVELS - l)) + 1;
-        const uint32_t  gridStep    = (1 << l);
-        engine.local.gridSize[l]     = gridDensity * (gridDensity - 1) * 4;
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, engine.gl.gridIndice[l]);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, engine.local.gridSize[l] * sizeof(uint32_t), nullptr, GL_STATIC_DRAW);
-        uint32_t *indice = (uint32_t *) glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);
-        uint32_t c = 0;
-        for(uint16_t h = 0; h < gridDensity; ++ h)
-            for(uint16_t w = 0; w < gridDensity - 1; ++ w)
+        const objects::Tile &tile = engine.local.tile[t];
+        if(raster)
+        {
+            const double pixels = tile.size * engine.local.d2d.zoom / (1 << DETAIL_LEVELS);
+            level[tile.order] = pixels > 0.0 ? min<double>(DETAIL_LEVELS - 1, max<double>(tile.detail, floor(-log2(pixels)))) : DETAIL_LEVELS - 1;
+        }
+
+        else if(engine.options.lod)
+            level[tile.order] = min<int>(DETAIL_LEVELS - 1, max<int>(tile.detail, max(0, lod + 8 - LOD[tile.order]) / 10 + (tile.order != 4)));
+
+        else
+            level[tile.order] = selectLevel(tile);
+
+        // Empty tiles are flat, in 3D a coarse grid still follows the sphere
+        if(!raster && engine.options.lod && tile.layer == engine::EMPTY_LAYER)
+            level[tile.order] = engine.options.viewType == engine::VIEW_2D ? DETAIL_LEVELS - 1 : DETAIL_LEVELS - 5;
+    }
+
+    Instance    instances[9];
+    uint8_t     levels[9];
+    uint32_t    count   = 0;
+    for(uint8_t t = 0; t < 9; ++ t)
+    {
+        // Freshly swapped in tile, its upload has to be done first
+        objects::Tile &tile = engine.local.tile[t];
+        if(tile.fence)
+        {
+            glWaitSync(tile.fence, 0, GL_TIMEOUT_IGNORED);
+            glDeleteSync(tile.fence);
+            tile.fence = nullptr;
+        }
+
+        // Nothing loaded into its layer yet
+        if(!tile.size)
+            continue;
+
+        if(!isVisible(tile))
+        {
+            ++ culled;
+            continue;
+        }
+
+        // Shared sides use the coarser of the two levels, window borders the own one
+        const uint8_t o = tile.order;
+        instances[count].box    = tile.box;
+        instances[count].data   = glm::ivec4(tile.layer, t, level[o], 0);
+        instances[count].edges  = glm::ivec4(
+            max(level[o], o > 2 ? level[o - 3] : level[o]),
+            max(level[o], o % 3 < 2 ? level[o + 1] : level[o]),
+            max(level[o], o < 6 ? level[o + 3] : level[o]),
+            max(level[o], o % 3 > 0 ? level[o - 1] : level[o]));
+
+        // Adaptive meshes of the level go last, past the grid levels
+        levels[count ++] = engine.local.meshSize[tile.layer * DETAIL_LEVELS + level[o]] ? DETAIL_LEVELS : level[o];
+    }
+
+    if(raster)
+        drawRaster(instances, count);
+
+    else
+        drawTiles(instances, levels, count);
+
+    markDrawn();
+    center = level[4];
+    return culled;
+}
+
+// Coarsest level, no finer than the tile's samples, whose height error fits
+// the budget on screen: at the zoom in 2D, at the distance of the tile's
+// nearest point in 3D, where the sphere sagging under its cells adds up
+inline
+uint8_t Drawer::selectLevel(const objects::Tile &tile)
+{
+    double scale    = engine.local.d2d.zoom;
+    double distance = 1.0;
+    double spacing  = 0.0;
+    if(engine.options.viewType == engine::VIEW_3D && tile.size)
+    {
+        const int   grid    = 5;
+        const double radius = mercator::EQUATORIAL_RADIUS + (tile.heights.x + tile.heights.y) / 2.0 - 1000.0;
+        double lat[grid];
+        double lon[grid];
+        for(int g = 0; g < grid; ++ g)
+        {
+            lat[g] = mercator::metToLat(tile.box.z + (tile.box.w - tile.box.z) * g / (grid - 1)) * M_PI / 180.0;
+            lon[g] = mercator::metToLon(tile.box.x + (tile.box.y - tile.box.x) * g / (grid - 1)) * M_PI / 180.0;
+        }
+
+        // Nearest sample, less half the widest step between samples
+        double step = 0.0;
+        distance = HUGE_VAL;
+        for(int h = 0; h < grid; ++ h)
+            for(int w = 0; w < grid; ++ w)
             {
-                uint32_t current    = density * gridStep * h + gridStep * w;
-                indice[c ++] = current;
-                indice[c ++] = current + gridStep;
+                const glm::dvec3 point = radius * glm::dvec3(cos(lat[h]) * cos(lon[w]), cos(lat[h]) * sin(lon[w]), sin(lat[h]));
+                distance = min(distance, glm::distance(engine.local.d3d.eye, point));
+                if(h && w)
+                    step = max(step, glm::distance(point, radius * glm::dvec3(cos(lat[h - 1]) * cos(lon[w - 1]), cos(lat[h - 1]) * sin(lon[w - 1]), sin(lat[h - 1]))));
             }
 
-        for(uint16_t w = 0; w < gridDensity; ++ w)
-            for(uint16_t h = 0; h < gridDensity - 1; ++ h)
-            {
-                uint32_t current    = density * gridStep * h + gridStep * w,
-                         next       = current + density * gridStep;
+        // Ground spacing of the finest level, mercator meters shrink with the latitude
+        const double widest = tile.box.z < 0.0 && tile.box.w > 0.0 ? 1.0 : max(cos(lat[0]), cos(lat[grid - 1]));
+        scale       = engine.local.d3d.projection[1][1] * engine.options.height / 2.0;
+        distance    = max(10.0, distance - step / 2.0);
+        spacing     = tile.size * widest / (1 << DETAIL_LEVELS);
+    }
 
-                indice[c ++] = current;
-                indice[c ++] = next;
-            }
+    const double limit = budget * distance / scale;
+    for(uint8_t l = DETAIL_LEVELS - 1; l > tile.detail; -- l)
+    {
+        const double cell = spacing * (1 << l);
+        if(tile.errors[l] + cell * cell / (8.0 * mercator::EQUATORIAL_RADIUS) <= limit)
+            return l;
+    }
 
-        assert(c == engine.local.gridSize[l]);
-        glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    return tile.detail;
+}
+
+// Loader waits for it before reusing layers swapped out or clipmap texels
+// uncovered meanwhile
+inline
+void Drawer::markDrawn(void)
+{
+    if(GLEW_ARB_sync)
+    {
+        if(engine.gl.drawn)
+            glDeleteSync(engine.gl.drawn);
+
+        engine.gl.drawn = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
     }
 }
 
+// Whole frame's drawing, read back by updateBudget once the GPU is done
 inline
-void Drawer::drawTerrain(int lod)
+void Drawer::beginTimer(void)
 {
-    const int LOD[9] = {3, 7, 2, 4, 8, 6, 0, 5, 1};
-    for(uint8_t t = 0; t < 9; ++ t)
-        drawTile(engine.local.tile[t], max(0, lod + 8 - LOD[engine.local.tile[t].order]) / 10);
+    if(timed)
+        glBeginQuery(GL_TIME_ELAPSED, timers[timer % TIMERS]);
 }
 
+inline
+void Drawer::endTimer(void)
+{
+    if(!timed)
+        return;
+
+    glEndQuery(GL_TIME_ELAPSED);
+    ++ timer;
+}
+
+// Oldest query, the one about to be reused, when done. The budget steps up
+// while over the target and down only once well under it, so it settles
+// instead of moving tiles between levels every frame.
+inline
+void Drawer::updateBudget(void)
+{
+    if(!timed || timer < TIMERS)
+        return;
+
+    const GLuint query = timers[timer % TIMERS];
+    GLint available = 0;
+    glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if(!available)
+        return;
+
+    GLuint64 elapsed = 0;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+    gpuTime = gpuTime ? 0.9 * gpuTime + 0.1 * elapsed / 1e9 : elapsed / 1e9;
+
+    const double target = BUDGET_TARGET / DRAWER_FPS;
+    if(gpuTime > BUDGET_OVER * target)
+        budget = min(BUDGET_MAX, budget * 1.1f);
+
+    else if(gpuTime < BUDGET_UNDER * target)
+        budget = max(BUDGET_MIN, budget / 1.1f);
+}
+
+// Bounding points of the tile: corners at both height extremes in 2D, a grid
+// lifted to the sphere in 3D with the outer shell pushed out to cover the
+// surface bulging between them. Culled when all of them are outside one
+// frustum plane or, in 3D, all of the outer ones are below the horizon.
+inline
+bool Drawer::isVisible(const objects::Tile &tile)
+{
+    if(!tile.size)
+        return true;
+
+    const int   grid        = 5;
+    glm::dvec3  points[2 * grid * grid];
+    uint32_t    count       = 0;
+    glm::dmat4  MVP;
+    if(engine.options.viewType == engine::VIEW_2D)
+    {
+        MVP = engine.local.d2d.projection * engine.local.d2d.view;
+        for(uint8_t c = 0; c < 8; ++ c)
+            points[count ++] = glm::dvec3(c & 1 ? tile.box.y : tile.box.x, c & 2 ? tile.box.w : tile.box.z, c & 4 ? tile.heights.y : tile.heights.x);
+    }
+
+    else
+    {
+        MVP = engine.local.d3d.projection * engine.local.d3d.view;
+        double lat[grid];
+        double lon[grid];
+        for(int g = 0; g < grid; ++ g)
+        {
+            lat[g] = mercator::metToLat(tile.box.z + (tile.box.w - tile.box.z) * g / (grid - 1)) * M_PI / 180.0;
+            lon[g] = mercator::metToLon(tile.box.x + (tile.box.y - tile.box.x) * g / (grid - 1)) * M_PI / 180.0;
+        }
+
+        double spacing = 0.0;
+        for(int g = 1; g < grid; ++ g)
+            spacing = max(spacing, sqrt((lat[g] - lat[g - 1]) * (lat[g] - lat[g - 1]) + (lon[g] - lon[g - 1]) * (lon[g] - lon[g - 1])));
+
+        const double inner = mercator::EQUATORIAL_RADIUS + tile.heights.x - 1000.0;
+        const double outer = (mercator::EQUATORIAL_RADIUS + tile.heights.y - 1000.0) / cos(min(spacing, M_PI_2) / 2.0);
+        for(int h = 0; h < grid; ++ h)
+            for(int w = 0; w < grid; ++ w)
+            {
+                const glm::dvec3 normal(cos(lat[h]) * cos(lon[w]), cos(lat[h]) * sin(lon[w]), sin(lat[h]));
+                points[count ++] = normal * outer;
+                points[count ++] = normal * inner;
+            }
+
+        // Horizon of the lowest drawn surface, in its radius units
+        const glm::dvec3    eye     = engine.local.d3d.eye / (mercator::EQUATORIAL_RADIUS - 1000.0);
+        const double        horizon = glm::dot(eye, eye) - 1.0;
+        bool                hidden  = horizon > 0.0;
+        for(uint32_t p = 0; hidden && p < count; p += 2)
+        {
+            const glm::dvec3    target  = points[p] / (mercator::EQUATORIAL_RADIUS - 1000.0) - eye;
+            const double        behind  = -glm::dot(target, eye);
+            hidden = behind > horizon && behind * behind / glm::dot(target, target) > horizon;
+        }
+
+        if(hidden)
+            return false;
+    }
+
+    // Left, right, bottom, top and near planes (far one is at infinity)
+    uint8_t outside[5] = {};
+    for(uint32_t p = 0; p < count; ++ p)
+    {
+        const glm::dvec4 clip = MVP * glm::dvec4(points[p], 1.0);
+        outside[0] += clip.x < -clip.w;
+        outside[1] += clip.x > clip.w;
+        outside[2] += clip.y < -clip.w;
+        outside[3] += clip.y > clip.w;
+        outside[4] += clip.z < -clip.w;
+    }
+
+    for(uint8_t o = 0; o < 5; ++ o)
+        if(outside[o] == count)
+            return false;
+
+    return true;
+}
+
+// Lines every 2^lod cells of a 1024 cell world. In 2D the quad is the map
+// in view, in grid cells from a line near it; in 3D it is the screen, rays
+// are cast from the eye onto the sphere. Positions stay relative to keep
+// single precision enough in the shaders.
 inline
 void Drawer::drawGrid(int lod)
 {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, engine.gl.gridIndice[lod]);
+    const double    spacing = 2.0 * MERCATOR_BOUNDS / (1 << (DETAIL_LEVELS - lod));
+    const double    radius  = mercator::EQUATORIAL_RADIUS;
+    glm::dmat4      MVP;
+    glm::vec4       grid;
+    if(engine.options.viewType == engine::VIEW_2D)
+    {
+        glm::dvec4 rect = glm::clamp(engine.getBoundingRect(), -MERCATOR_BOUNDS, MERCATOR_BOUNDS);
+        if(rect.x >= rect.y || rect.z >= rect.w)
+            return;
+
+        const glm::dvec3 origin(floor(rect.x / spacing) * spacing, floor(rect.z / spacing) * spacing, 0.0);
+        MVP = engine.local.d2d.projection * engine.local.d2d.view * glm::scale(glm::translate(glm::dmat4(1.0), origin), glm::dvec3(spacing, spacing, 1.0));
+        grid = glm::vec4((rect.x - origin.x) / spacing, (rect.y - origin.x) / spacing, (rect.z - origin.y) / spacing, (rect.w - origin.y) / spacing);
+    }
+
+    else
+    {
+        MVP = engine.local.d3d.projection * engine.local.d3d.view * glm::translate(glm::dmat4(1.0), engine.local.d3d.eye);
+        grid = glm::vec4(radius / spacing, MERCATOR_BOUNDS / spacing, 0.0, 0.0);
+    }
+
     glBindBuffer(GL_ARRAY_BUFFER, engine.gl.buffer[engine::GRID_BUFFER]);
     glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
     glUseProgram(getProgram(GRID_PROGRAM));
 
-    glm::mat4 uniform = engine.getUniform();
+    const glm::mat4 uniform(MVP);
     glUniformMatrix4fv(getMVP(GRID_PROGRAM), 1, GL_FALSE, &uniform[0][0]);
+    glUniform4fv(getGRID(GRID_PROGRAM), 1, &grid[0]);
+    if(engine.options.viewType == engine::VIEW_3D)
+    {
+        const glm::dvec3    &eye        = engine.local.d3d.eye;
+        const glm::mat4     unproject(glm::inverse(MVP));
+        glUniformMatrix4fv(getUNPROJECT(GRID_PROGRAM), 1, GL_FALSE, &unproject[0][0]);
+        glUniform4f(getEYE(GRID_PROGRAM), eye.x, eye.y, eye.z, glm::dot(eye, eye) - radius * radius);
+    }
 
-    glDrawElements(GL_LINES, engine.local.gridSize[lod], GL_UNSIGNED_INT, nullptr);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
     glUseProgram(0);
     glDisableVertexAttribArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
+// Instances sorted by level, every level in use is a single instanced draw,
+// adaptively meshed tiles are drawn one by one with their level's range
 inline
-void Drawer::drawTile(const objects::Tile &tile, int lod)
+void Drawer::drawTiles(Instance *instances, uint8_t *levels, uint32_t count)
 {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, engine.gl.tileIndice[lod]);
-    glBindBuffer(GL_ARRAY_BUFFER, tile.buffer);
+    for(uint32_t i = 1; i < count; ++ i)
+        for(uint32_t j = i; j > 0 && levels[j - 1] > levels[j]; -- j)
+        {
+            swap(instances[j - 1], instances[j]);
+            swap(levels[j - 1], levels[j]);
+        }
+
+    glBindBuffer(GL_UNIFORM_BUFFER, engine.gl.buffer[engine::INSTANCE_BUFFER]);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Instance) * count, instances);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, engine.gl.buffer[engine::TILE_BUFFER]);
     glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 1, GL_UNSIGNED_SHORT, GL_FALSE, 0, nullptr);
+    glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_FALSE, 0, nullptr);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, engine.gl.trig);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, engine.gl.heights);
     glUseProgram(getProgram(TILE_PROGRAM));
 
     glm::mat4 uniform = engine.getUniform();
     glUniformMatrix4fv(getMVP(TILE_PROGRAM), 1, GL_FALSE, &uniform[0][0]);
-    glUniform4fv(getBOX(TILE_PROGRAM), 1, &tile.box.x);
 
-    glDrawElements(GL_TRIANGLES, engine.local.tileSize[lod], GL_UNSIGNED_INT, nullptr);
+    for(uint32_t first = 0, last = 0; first < count; first = last)
+    {
+        while(last < count && levels[last] == levels[first])
+            ++ last;
+
+        if(levels[first] == DETAIL_LEVELS)
+        {
+            for(uint32_t i = first; i < last; ++ i)
+            {
+                const uint32_t layer = instances[i].data.x;
+                const uint32_t range = layer * DETAIL_LEVELS + instances[i].data.z;
+                glUniform1i(getFIRST(TILE_PROGRAM), i);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, engine.gl.meshIndice[layer]);
+                glDrawElements(GL_TRIANGLES, engine.local.meshSize[range], GL_UNSIGNED_INT, (const GLvoid *) (engine.local.meshFirst[range] * sizeof(uint32_t)));
+                triangles += engine.local.meshSize[range] / 3;
+            }
+
+            continue;
+        }
+
+        glUniform1i(getFIRST(TILE_PROGRAM), first);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, engine.gl.tileIndice[levels[first]]);
+        glDrawElementsInstanced(GL_TRIANGLES, engine.local.tileSize[levels[first]], GL_UNSIGNED_INT, nullptr, last - first);
+        triangles += engine.local.tileSize[levels[first]] / 3 * (last - first);
+    }
 
     glUseProgram(0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
     glDisableVertexAttribArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
+// A quad per tile, coloured per fragment from the heights of its level as
+// its mesh would be, all in one instanced draw
+inline
+void Drawer::drawRaster(const Instance *instances, uint32_t count)
+{
+    glBindBuffer(GL_UNIFORM_BUFFER, engine.gl.buffer[engine::INSTANCE_BUFFER]);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Instance) * count, instances);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, engine.gl.buffer[engine::GRID_BUFFER]);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, engine.gl.heights);
+    glUseProgram(getProgram(RASTER_PROGRAM));
+
+    glm::mat4 uniform = engine.getUniform();
+    glUniformMatrix4fv(getMVP(RASTER_PROGRAM), 1, GL_FALSE, &uniform[0][0]);
+    glUniform1i(getFIRST(RASTER_PROGRAM), 0);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+
+    glUseProgram(0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glDisableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Finest level drawn whole, each coarser one as the ring around the previous.
+// Returns false until the loader has filled the levels in use.
+inline
+bool Drawer::drawClipmap(void)
+{
+    lock_guard<mutex> _lock(engine.local.tileLock);
+    engine::Engine::Local::Clipmap &clipmap = engine.local.clipmap;
+    if(!clipmap.ready)
+        return false;
+
+    if(clipmap.fence)
+    {
+        glWaitSync(clipmap.fence, 0, GL_TIMEOUT_IGNORED);
+        glDeleteSync(clipmap.fence);
+        clipmap.fence = nullptr;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, engine.gl.buffer[engine::CLIPMAP_BUFFER]);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_FALSE, 0, nullptr);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, engine.gl.clipmapTrig);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, engine.gl.clipmapHeights);
+    glUseProgram(getProgram(CLIPMAP_PROGRAM));
+
+    glm::mat4 uniform = engine.getUniform();
+    glUniformMatrix4fv(getMVP(CLIPMAP_PROGRAM), 1, GL_FALSE, &uniform[0][0]);
+
+    // Texels are addressed by world grid index modulo the level size, origins are even
+    const auto wrap = [](int32_t index) {return (index % CLIPMAP_SIZE + CLIPMAP_SIZE) % CLIPMAP_SIZE;};
+    const uint32_t last = clipmap.first + CLIPMAP_ACTIVE - 1;
+    for(uint32_t l = clipmap.first; l <= last; ++ l)
+    {
+        const glm::ivec2 &origin = clipmap.origin[l];
+        uint32_t ring = engine::CLIPMAP_FULL;
+        if(l > clipmap.first)
+        {
+            const glm::ivec2 offset = clipmap.origin[l - 1] / 2 - origin - (CLIPMAP_SIZE - 1) / 4;
+            assert(abs(offset.x) <= 1 && abs(offset.y) <= 1);
+            ring = engine::CLIPMAP_RING_1 + (offset.y + 1) * 3 + offset.x + 1;
+        }
+
+        // Outermost level has no coarser one to meet
+        if(l < last)
+            glUniform4i(getLEVEL(CLIPMAP_PROGRAM), wrap(origin.x), wrap(origin.y), wrap(origin.x / 2), wrap(origin.y / 2));
+
+        else
+            glUniform4i(getLEVEL(CLIPMAP_PROGRAM), wrap(origin.x), wrap(origin.y), -1, -1);
+
+        glUniform1i(getLAYER(CLIPMAP_PROGRAM), l);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, engine.gl.clipmapIndice[ring]);
+        glDrawElements(GL_TRIANGLES, engine.local.clipmapSize[ring], GL_UNSIGNED_INT, nullptr);
+    }
+
+    glUseProgram(0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glDisableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    markDrawn();
+    return true;
+}
+
 inline
 void Drawer::loadPrograms(void)
 {
     log.debug("Loading programs");
     engine.gl.program[engine::VIEW_2D][GRID_PROGRAM] = loadProgram("src/shaders/2d/grid.vertex.glsl", "src/shaders/2d/grid.fragment.glsl");
     engine.gl.MVP[engine::VIEW_2D][GRID_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_2D][GRID_PROGRAM], "MVP");
+    engine.gl.GRID[engine::VIEW_2D][GRID_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_2D][GRID_PROGRAM], "grid");
 
     engine.gl.program[engine::VIEW_2D][TILE_PROGRAM] = loadProgram("src/shaders/2d/tile.vertex.glsl", "src/shaders/2d/tile.fragment.glsl");
     engine.gl.MVP[engine::VIEW_2D][TILE_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_2D][TILE_PROGRAM], "MVP");
-    engine.gl.BOX[engine::VIEW_2D][TILE_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_2D][TILE_PROGRAM], "box");
+    engine.gl.FIRST[engine::VIEW_2D][TILE_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_2D][TILE_PROGRAM], "first");
+    setupTileProgram(engine.gl.program[engine::VIEW_2D][TILE_PROGRAM]);
+
+    engine.gl.program[engine::VIEW_2D][RASTER_PROGRAM] = loadProgram("src/shaders/2d/raster.vertex.glsl", "src/shaders/2d/raster.fragment.glsl");
+    engine.gl.MVP[engine::VIEW_2D][RASTER_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_2D][RASTER_PROGRAM], "MVP");
+    engine.gl.FIRST[engine::VIEW_2D][RASTER_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_2D][RASTER_PROGRAM], "first");
+    setupTileProgram(engine.gl.program[engine::VIEW_2D][RASTER_PROGRAM]);
 
     engine.gl.program[engine::VIEW_3D][GRID_PROGRAM] = loadProgram("src/shaders/3d/grid.vertex.glsl", "src/shaders/3d/grid.fragment.glsl");
     engine.gl.MVP[engine::VIEW_3D][GRID_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_3D][GRID_PROGRAM], "MVP");
+    engine.gl.GRID[engine::VIEW_3D][GRID_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_3D][GRID_PROGRAM], "grid");
+    engine.gl.EYE[engine::VIEW_3D][GRID_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_3D][GRID_PROGRAM], "eye");
+    engine.gl.UNPROJECT[engine::VIEW_3D][GRID_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_3D][GRID_PROGRAM], "unproject");
 
     engine.gl.program[engine::VIEW_3D][TILE_PROGRAM] = loadProgram("src/shaders/3d/tile.vertex.glsl", "src/shaders/3d/tile.fragment.glsl");
     engine.gl.MVP[engine::VIEW_3D][TILE_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_3D][TILE_PROGRAM], "MVP");
-    engine.gl.BOX[engine::VIEW_3D][TILE_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_3D][TILE_PROGRAM], "box");
+    engine.gl.FIRST[engine::VIEW_3D][TILE_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_3D][TILE_PROGRAM], "first");
+    setupTileProgram(engine.gl.program[engine::VIEW_3D][TILE_PROGRAM]);
+
+    engine.gl.program[engine::VIEW_3D][CLIPMAP_PROGRAM] = loadProgram("src/shaders/3d/clipmap.vertex.glsl", "src/shaders/3d/tile.fragment.glsl");
+    engine.gl.MVP[engine::VIEW_3D][CLIPMAP_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_3D][CLIPMAP_PROGRAM], "MVP");
+    engine.gl.LEVEL[engine::VIEW_3D][CLIPMAP_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_3D][CLIPMAP_PROGRAM], "level");
+    engine.gl.LAYER[engine::VIEW_3D][CLIPMAP_PROGRAM] = glGetUniformLocation(engine.gl.program[engine::VIEW_3D][CLIPMAP_PROGRAM], "layer");
+    setupTileProgram(engine.gl.program[engine::VIEW_3D][CLIPMAP_PROGRAM]);
+}
+
+// Samplers and the instance block never change, clipmap levels have no block
+inline
+void Drawer::setupTileProgram(GLuint program)
+{
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "heights"), 0);
+    glUniform1i(glGetUniformLocation(program, "trig"), 1);
+    const GLuint block = glGetUniformBlockIndex(program, "Instances");
+    if(block != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, block, 0);
+
+    glUseProgram(0);
 }
 
 inline
@@ -390,9 +940,39 @@ GLuint &Drawer::getMVP(int view)
 }
 
 inline
-GLuint &Drawer::getBOX(int view)
+GLuint &Drawer::getFIRST(int view)
+{
+    return engine.gl.FIRST[engine.options.viewType][view];
+}
+
+inline
+GLuint &Drawer::getLEVEL(int view)
+{
+    return engine.gl.LEVEL[engine.options.viewType][view];
+}
+
+inline
+GLuint &Drawer::getLAYER(int view)
+{
+    return engine.gl.LAYER[engine.options.viewType][view];
+}
+
+inline
+GLuint &Drawer::getGRID(int view)
+{
+    return engine.gl.GRID[engine.options.viewType][view];
+}
+
+inline
+GLuint &Drawer::getEYE(int view)
+{
+    return engine.gl.EYE[engine.options.viewType][view];
+}
+
+inline
+GLuint &Drawer::getUNPROJECT(int view)
 {
-    return engine.gl.BOX[engine.options.viewType][view];
+    return engine.gl.UNPROJECT[engine.options.viewType][view];
 }
 
 inline
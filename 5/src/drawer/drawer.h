@@ -1,6 +1,8 @@
 #ifndef __DRAWER_H__
 #define __DRAWER_H__
 
+#include <glm/glm.hpp>
+
 #include "libs/logger/logger.h"
 #include "libs/thread/thread.h"
 
@@ -12,10 +14,24 @@ namespace terrain
 namespace drawer
 {
 
+// Terrain GPU time queries in flight, read back a few frames late
+static const uint32_t   TIMERS          = 3;
+
+// Screen space error budget (pixels): start, bounds and GPU time target as a
+// share of the frame, it only changes outside of the hysteresis band
+static const float      BUDGET_INITIAL  = 2.0f;
+static const float      BUDGET_MIN      = 0.5f;
+static const float      BUDGET_MAX      = 64.0f;
+static const double     BUDGET_TARGET   = 0.75;
+static const double     BUDGET_OVER     = 1.1;
+static const double     BUDGET_UNDER    = 0.8;
+
 enum Program
 {
     GRID_PROGRAM = 0,
     TILE_PROGRAM = 1,
+    CLIPMAP_PROGRAM = 2,
+    RASTER_PROGRAM = 3,
 }; // enum Program
 
 class Drawer: public Thread
@@ -23,6 +39,25 @@ class Drawer: public Thread
     private:
         Logger          log;
         engine::Engine  &engine;
+        uint32_t        layers;
+
+        // Tiles are drawn at the coarsest level whose projected error fits
+        // the budget, which follows the terrain GPU time
+        float           budget;
+        uint8_t         center;
+        bool            timed;
+        GLuint          timers[TIMERS];
+        uint32_t        timer;
+        double          gpuTime;
+        uint64_t        triangles;
+
+        // Per tile draw data, std140 layout of the Instances uniform block
+        struct Instance
+        {
+            glm::vec4   box;
+            glm::ivec4  data;   // height layer, trig row, level
+            glm::ivec4  edges;  // levels of the bottom, right, top and left sides
+        }; // struct Instance
 
     public:
         Drawer(Log &_log, engine::Engine &_engine);
@@ -38,18 +73,33 @@ class Drawer: public Thread
         void setupGL(void);
         void generateTile(void);
         void generateGrid(void);
+        void generateClipmap(void);
 
         void drawGrid(int lod);
-        void drawTerrain(int lod);
-        void drawTile(const objects::Tile &tile, int lod);
+        uint8_t drawTerrain(int lod);
+        uint8_t selectLevel(const objects::Tile &tile);
+        bool isVisible(const objects::Tile &tile);
+        void drawTiles(Instance *instances, uint8_t *levels, uint32_t count);
+        void drawRaster(const Instance *instances, uint32_t count);
+        bool drawClipmap(void);
+        void markDrawn(void);
+        void beginTimer(void);
+        void endTimer(void);
+        void updateBudget(void);
 
         void loadPrograms(void);
         GLuint loadProgram(const char *vertex, const char *fragment);
+        void setupTileProgram(GLuint program);
         void loadShader(const GLuint shader, const char *filename);
 
         GLuint &getProgram(int view);
         GLuint &getMVP(int view);
-        GLuint &getBOX(int view);
+        GLuint &getFIRST(int view);
+        GLuint &getLEVEL(int view);
+        GLuint &getLAYER(int view);
+        GLuint &getGRID(int view);
+        GLuint &getEYE(int view);
+        GLuint &getUNPROJECT(int view);
 
         void throwError(const char *message);
 
@@ -3,14 +3,21 @@
 
 #include <cstring>
 #include <cstdio>
+#include <chrono>
+#include <unistd.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/quaternion.hpp>
 #include <glm/gtx/vector_angle.hpp>
 
+#include "libs/thread/pool.h"
+
 #include "hgt/file.h"
 #include "hgt/map.h"
+#include "hgt/convert.h"
+#include "hgt/world.h"
+#include "hgt/archive.h"
 #include "projection/mercator.h"
 
 #include "drawer/drawer.h"
@@ -54,6 +61,11 @@ Engine::Engine(Log &_debug)
     options.lod         = 0;
     options.viewType    = engine::VIEW_2D;
     options.fov         = 45.0;
+    options.clipmap     = false;
+    options.raster      = true;
+    options.meshError   = MESH_ERROR;
+    options.memory      = WORLD_MEMORY_BUDGET;
+    options.preload     = false;
 
     // LOCAL
     //// 2D
@@ -67,6 +79,9 @@ Engine::Engine(Log &_debug)
     local.d3d.right     = glm::dvec3(0.0, -1.0, 0.0);
     local.d3d.up        = glm::dvec3(0.0, 0.0, 1.0);
 
+    //// MAPS
+    local.world.setLog(_debug);
+
     // BOUND
     local.bound.min.x   = MERCATOR_BOUNDS;
     local.bound.min.y   = MERCATOR_BOUNDS;
@@ -116,9 +131,32 @@ Engine::~Engine(void)
 void Engine::run(int argc, char **argv)
 {
     log.debug("Starting up...");
-    log.debug("Loading %d maps", argc - 1);
-    for(int a = 1; a < argc; ++ a)
-        loadMap(argv[a]);
+    for(int opt = 0; (opt = getopt(argc, argv, "ce:m:p")) != -1; )
+        switch(opt)
+        {
+            case 'c':
+                options.clipmap = true;
+                break;
+
+            case 'e':
+                options.meshError = max(0.0, atof(optarg));
+                break;
+
+            case 'm':
+                options.memory = max(1, atoi(optarg));
+                break;
+
+            case 'p':
+                options.preload = true;
+                break;
+
+            default:
+                throw runtime_error("Usage: terrain [-c] [-e max mesh error in m] [-m memory budget in MB] [-p] maps...");
+                break;
+        }
+
+    log.debug("Loading %d maps", argc - optind);
+    loadMaps(argc - optind, argv + optind);
 
     local.d2d.eye = glm::dvec3(
         (local.bound.max.x + local.bound.min.x) / 2.0,
@@ -146,76 +184,104 @@ void Engine::terminate(void)
 }
 
 inline
-void Engine::loadMap(const char *path)
+void Engine::loadMaps(int count, char **paths)
 {
-    log.debug("Loading %s map", path);
-    char parse[1024]    = {},
-         *filename      = nullptr;
+    vector<Registered> registered;
+    registered.reserve(count);
+    local.world.setBudget(options.memory * 1048576LU);
+    for(int p = 0; p < count; ++ p)
+    {
+        const char *extension = strrchr(paths[p], '.');
+        if(extension && !strcmp(extension + 1, "hgta"))
+        {
+            registerArchive(paths[p], registered);
+            continue;
+        }
+
+        registered.push_back(Registered());
+        Registered &map = registered.back();
+        registerMap(paths[p], map.filename, map.lat, map.lon);
+        local.bound.max.x = max(local.bound.max.x, mercator::lonToMet(map.lon + 1));
+        local.bound.max.y = max(local.bound.max.y, mercator::latToMet(map.lat + 1));
+        local.bound.min.x = min(local.bound.min.x, mercator::lonToMet(map.lon));
+        local.bound.min.y = min(local.bound.min.y, mercator::latToMet(map.lat));
+    }
 
-    int32_t lat = 0,
-            lon = 0;
+    log.info("Registered %zu maps, memory budget: %u MB", registered.size(), options.memory);
+    if(!options.preload)
+        return;
 
-    strncpy(parse, path, 1023);
-    parseMapFilename(parse, filename, lat, lon);
-    log.debug("Loading %s square (%d %d)", filename, lon, lat);
+    if(registered.size() * hgt::MAP_SIZE > options.memory * 1048576LU)
+    {
+        log.info("Maps don't fit in the memory budget, loading them on demand");
+        return;
+    }
+
+    // Asked for and everything fits, preload in parallel
+    ThreadPool pool;
+    const char *kernel = nullptr;
+    hgt::converter(&kernel);
+    log.debug("Loading maps on %u threads, converting with %s kernel", pool.size(), kernel);
 
-    hgt::Map &chunk = local.world[lat][lon];
-    hgt::File map(path);
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    pool.run(registered.size(), [&](uint32_t m)
+    {
+        const chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        local.world.get(registered[m].lat, registered[m].lon);
+        registered[m].time = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    });
 
-    for(int h = 0; h < 1201; ++ h)
-        for(int w = 0; w < 1201; ++ w)
-            chunk.set(w, h, map.get(w, h) + 1000);
+    const double time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for(Registered &map: registered)
+        log.debug("Loaded %s square (%d %d) in %.4lfs [%.2lf MB/s]", map.filename, map.lon, map.lat, map.time, hgt::FILE_SIZE / map.time / 1048576.0);
 
-    local.bound.max.x = max(local.bound.max.x, mercator::lonToMet(lon + 1));
-    local.bound.max.y = max(local.bound.max.y, mercator::latToMet(lat + 1));
-    local.bound.min.x = min(local.bound.min.x, mercator::lonToMet(lon));
-    local.bound.min.y = min(local.bound.min.y, mercator::latToMet(lat));
-    log.debug("Loaded data from %s", filename);
+    log.info("Loaded %zu maps (%.2lf MB) in %.4lfs [%.2lf MB/s]", registered.size(), registered.size() * hgt::FILE_SIZE / 1048576.0, time, registered.size() * hgt::FILE_SIZE / time / 1048576.0);
 }
 
 inline
-void Engine::parseMapFilename(char *path, char *&filename, int32_t &lat, int32_t &lon)
-{
-    char *extension = nullptr,
-         nPos[2]    = {},
-         nDeg[4]    = {},
-         wPos[2]    = {},
-         wDeg[4]    = {};
-
-    filename = basename(path);
-    if(!(extension = strrchr(filename, '.')) || strcmp(extension + 1, "hgt"))
-        throw runtime_error("Invalid map file type");
-
-    *extension = 0;
-    sscanf(filename, "%1[nNsS]%3[0123456789]%1[wWeE]%3[0123456789]", nPos, nDeg, wPos, wDeg);
-    sscanf(nDeg, "%d", &lat);
-    sscanf(wDeg, "%d", &lon);
-    switch(tolower(nPos[0]))
-    {
-        case 's':
-            lat *= -1;
-            break;
+void Engine::registerMap(const char *path, char *filename, int32_t &lat, int32_t &lon)
+{
+    char parse[1024]    = {},
+         *name          = nullptr;
 
-        case 'n':
-            break;
+    strncpy(parse, path, 1023);
+    hgt::parseFilename(parse, name, lat, lon);
+    strcpy(filename, name);
 
-        default:
-            throw runtime_error("Invalid map file name");
-            break;
-    }
+    // Loaded lazily later on, unusable files are refused up front
+    struct stat info;
+    if(stat(path, &info) == -1)
+        throw runtime_error(string("Couldn't open map file ") + path);
 
-    switch(tolower(wPos[0]))
-    {
-        case 'w':
-            lon *= -1;
-            break;
+    if((size_t) info.st_size != hgt::FILE_SIZE)
+        throw runtime_error(string("Invalid map file size ") + path);
 
-        case 'e':
-            break;
+    if(!local.world.add(lat, lon, path))
+        log.warning("Duplicate %s square (%d %d), ignoring %s", filename, lon, lat, path);
+}
 
-        default:
-            throw runtime_error("Invalid map file name");
-            break;
+inline
+void Engine::registerArchive(const char *path, vector<Registered> &registered)
+{
+    shared_ptr<hgt::Archive> archive = make_shared<hgt::Archive>(path);
+    const hgt::ArchiveHeader &header = archive->getHeader();
+    log.debug("Registering %u maps from %s archive%s", header.count, path, archive->isConverted() ? " (converted)" : "");
+    local.world.add(archive);
+    if(!header.count)
+        return;
+
+    local.bound.max.x = max(local.bound.max.x, mercator::lonToMet(header.maxLon + 1));
+    local.bound.max.y = max(local.bound.max.y, mercator::latToMet(header.maxLat + 1));
+    local.bound.min.x = min(local.bound.min.x, mercator::lonToMet(header.minLon));
+    local.bound.min.y = min(local.bound.min.y, mercator::latToMet(header.minLat));
+    for(uint32_t e = 0; e < header.count; ++ e)
+    {
+        registered.push_back(Registered());
+        Registered &map = registered.back();
+        map.lat = archive->getEntry(e).lat;
+        map.lon = archive->getEntry(e).lon;
+        snprintf(map.filename, sizeof(map.filename), "%s:%c%02d%c%03d", basename(path),
+            map.lat < 0 ? 'S' : 'N', abs(map.lat), map.lon < 0 ? 'W' : 'E', abs(map.lon));
     }
 }
 
@@ -271,6 +337,8 @@ void Engine::updateView(void)
             throw runtime_error("Invalid view type");
             break;
     }
+
+    notifyView();
 }
 
 inline
@@ -285,6 +353,24 @@ void Engine::updateView3D(void)
     local.d3d.view = glm::lookAt(local.d3d.eye, local.d3d.eye + local.d3d.direction, local.d3d.up);
 }
 
+void Engine::notifyView(void)
+{
+    {
+        lock_guard<mutex> _lock(local.viewLock);
+        ++ local.viewVersion;
+    }
+
+    local.viewChanged.notify_all();
+}
+
+// Blocks until the view changes after the given version
+void Engine::waitView(uint64_t &version)
+{
+    unique_lock<mutex> _lock(local.viewLock);
+    local.viewChanged.wait(_lock, [&]{return local.viewVersion != version;});
+    version = local.viewVersion;
+}
+
 inline
 void Engine::changeViewType(void)
 {
@@ -367,18 +453,85 @@ glm::dvec4 Engine::getBoundingRect2D(void)
     return glm::dvec4(local.d2d.eye.x - res, local.d2d.eye.x + res, local.d2d.eye.y - res, local.d2d.eye.y + res);
 }
 
+// Mercator rect around the part of the globe seen through the frustum. Border
+// rays are intersected with the sphere, the ones missing it are clipped to
+// the horizon in their direction.
 inline
 glm::dvec4 Engine::getBoundingRect3D(void)
 {
-    double zoom = min(1.0, max(0.0001, 25.0 / (glm::length(local.d3d.eye) - mercator::EQUATORIAL_RADIUS)));
-    glm::dvec3 eye = glm::normalize(local.d3d.eye) * mercator::EQUATORIAL_RADIUS;
-    double lat = asin(eye.z / mercator::EQUATORIAL_RADIUS) * 180.0 / M_PI;
-    double lon = atan2(eye.y, eye.x) * 180.0 / M_PI;
-    eye.x = mercator::lonToMet(lon);
-    eye.y = mercator::latToMet(lat);
+    const double        radius      = mercator::EQUATORIAL_RADIUS;
+    const glm::dvec3    normal      = glm::normalize(local.d3d.eye);
+    const glm::dvec3    eye         = normal * max(glm::length(local.d3d.eye), radius + 1.0);
+    const double        horizon     = acos(radius / glm::length(eye));
+    const double        center      = atan2(normal.y, normal.x);
+
+    // Same basis and field of view as lookAt / infinitePerspective
+    const glm::dvec3    direction   = glm::normalize(local.d3d.direction);
+    const glm::dvec3    side        = glm::normalize(glm::cross(direction, local.d3d.up));
+    const glm::dvec3    up          = glm::cross(side, direction);
+    const double        vertical    = tan(options.fov / 2.0);
+    const double        horizontal  = vertical * options.width / options.height;
+
+    glm::dvec4 rect(MERCATOR_BOUNDS, -MERCATOR_BOUNDS, MERCATOR_BOUNDS, -MERCATOR_BOUNDS);
+    const int samples = 8;
+    for(int s = 0; s < 4 * samples; ++ s)
+    {
+        const double    f       = -1.0 + 2.0 * (s % samples) / samples;
+        const glm::dvec2 screen = s < samples ? glm::dvec2(f, -1.0)
+                                : s < 2 * samples ? glm::dvec2(1.0, f)
+                                : s < 3 * samples ? glm::dvec2(-f, 1.0)
+                                : glm::dvec2(-1.0, -f);
+
+        const glm::dvec3 ray    = glm::normalize(direction + side * screen.x * horizontal + up * screen.y * vertical);
+        const double    b       = glm::dot(eye, ray);
+        const double    d       = b * b - glm::dot(eye, eye) + radius * radius;
+
+        glm::dvec3 point;
+        if(b < 0.0 && d >= 0.0)
+            point = eye + ray * (-b - sqrt(d));
+
+        else
+        {
+            glm::dvec3 tangent = ray - normal * glm::dot(ray, normal);
+            if(glm::length(tangent) < 1e-9)
+                continue;
+
+            point = (normal * cos(horizon) + glm::normalize(tangent) * sin(horizon)) * radius;
+        }
+
+        // Longitudes unwrapped around the camera, so the rect can cross 180 degrees
+        const double lat = asin(point.z / glm::length(point));
+        const double lon = center + remainder(atan2(point.y, point.x) - center, 2.0 * M_PI);
+        const double x   = mercator::lonToMet(lon * 180.0 / M_PI);
+        const double y   = mercator::latToMet(lat * 180.0 / M_PI);
+        rect = glm::dvec4(min(rect.x, x), max(rect.y, x), min(rect.z, y), max(rect.w, y));
+    }
 
-    double res = sqrt(1.0 * options.width * options.width + options.height * options.height) / zoom / 2.0;
-    return glm::dvec4(eye.x - res, eye.x + res, eye.y - res, eye.y + res);
+    // Visible pole, every longitude meets there
+    for(double pole = -1.0; pole <= 1.0; pole += 2.0)
+    {
+        const glm::dvec3 point(0.0, 0.0, pole * radius);
+        const glm::dvec3 ray = glm::normalize(point - eye);
+        if(glm::dot(point - eye, point) >= 0.0 || glm::dot(ray, direction) <= 0.0
+        || fabs(glm::dot(ray, side) / glm::dot(ray, direction)) > horizontal
+        || fabs(glm::dot(ray, up) / glm::dot(ray, direction)) > vertical)
+            continue;
+
+        rect.x = -MERCATOR_BOUNDS;
+        rect.y = MERCATOR_BOUNDS;
+        rect.z = min(rect.z, pole * MERCATOR_BOUNDS);
+        rect.w = max(rect.w, pole * MERCATOR_BOUNDS);
+    }
+
+    // Looking straight away from the globe, keep the point below the camera
+    if(rect.x > rect.y)
+    {
+        const double x = mercator::lonToMet(center * 180.0 / M_PI);
+        const double y = mercator::latToMet(asin(normal.z) * 180.0 / M_PI);
+        rect = glm::dvec4(x - 1.0, x + 1.0, y - 1.0, y + 1.0);
+    }
+
+    return rect;
 }
 
 glm::mat4 Engine::getUniform(void)
@@ -438,6 +591,26 @@ void Engine::glfwKeyCallback(GLFWwindow */*window*/, int key, int/* scancode*/,
 
             break;
 
+        // Loader switches between tiles and clipmap levels once woken up
+        case GLFW_KEY_C:
+            if(action == GLFW_PRESS)
+            {
+                options.clipmap = !options.clipmap;
+                log.debug("Clipmap terrain: %s", options.clipmap ? "on" : "off");
+                notifyView();
+            }
+
+            break;
+
+        case GLFW_KEY_R:
+            if(action == GLFW_PRESS)
+            {
+                options.raster = !options.raster;
+                log.debug("Raster 2D terrain: %s", options.raster ? "on" : "off");
+            }
+
+            break;
+
         case GLFW_KEY_KP_ADD:
             if(action == GLFW_PRESS)
             {
@@ -653,6 +826,7 @@ void Engine::glfwWheelCallback(GLFWwindow */*window*/, double/* x*/, double y)
 
     local.d2d.zoom = min(1.0, max(0.0001, local.d2d.zoom * pow(1.25, y)));
     updateViewport();
+    notifyView();
 }
 
 void Engine::glfwWindowCloseCallback(GLFWwindow */*window*/)
@@ -665,5 +839,6 @@ void Engine::glfwWindowResizeCallback(GLFWwindow */*window*/, int _width, int _h
     options.width   = _width;
     options.height  = _height;
     updateViewport();
+    notifyView();
 }
 
@@ -3,6 +3,9 @@
 
 #include <unordered_map>
 #include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -12,7 +15,7 @@
 #include "libs/thread/thread.h"
 
 #include "objects.h"
-#include "hgt/map.h"
+#include "hgt/world.h"
 
 namespace terrain
 {
@@ -29,28 +32,30 @@ using namespace terrain::objects;
 
 enum Buffers
 {
-    TILE_BUFFER_1   = 0,
-    TILE_BUFFER_2   = 1,
-    TILE_BUFFER_3   = 2,
-    TILE_BUFFER_4   = 3,
-    TILE_BUFFER_5   = 4,
-    TILE_BUFFER_6   = 5,
-    TILE_BUFFER_7   = 6,
-    TILE_BUFFER_8   = 7,
-    TILE_BUFFER_9   = 8,
-
-    GRID_BUFFER     = 9,
-    SWAP_BUFFER_1   = 10,
-    SWAP_BUFFER_2   = 11,
-    SWAP_BUFFER_3   = 12,
-    SWAP_BUFFER_4   = 13,
-    SWAP_BUFFER_5   = 14,
-    SWAP_BUFFER_6   = 15,
-    SWAP_BUFFER_7   = 16,
-    SWAP_BUFFER_8   = 17,
-    SWAP_BUFFER_9   = 18
+    GRID_BUFFER     = 0,    // unit quad, for the background grid and raster tiles
+    TILE_BUFFER     = 1,    // shared tile mesh
+    INSTANCE_BUFFER = 2,    // per tile draw data (uniform block)
+    CLIPMAP_BUFFER  = 3     // shared clipmap level mesh
 }; // enum Buffers
 
+// Clipmap index buffers, a ring per offset of the finer level inside it, then the full grid
+enum Rings
+{
+    CLIPMAP_RING_1  = 0,
+    CLIPMAP_FULL    = 9
+}; // enum Rings
+
+// Height layers, the ones past the swap, empty and prefetch layers are spare
+// or cached tiles, tiles without any map share the empty one
+enum Layers
+{
+    TILE_LAYER_1        = 0,
+    SWAP_LAYER_1        = 9,
+    EMPTY_LAYER         = 18,
+    PREFETCH_LAYER_1    = 19,
+    SPARE_LAYER_1       = PREFETCH_LAYER_1 + PREFETCH_TILES
+}; // enum Layers
+
 enum ViewType
 {
     VIEW_2D = 0,
@@ -82,15 +87,57 @@ class Engine
         uint8_t     lod;
         ViewType    viewType;
         double      fov;
+
+        // GEOMETRY CLIPMAP INSTEAD OF TILES IN 3D
+        bool        clipmap;
+
+        // TILES AS COLOURED QUADS INSTEAD OF MESHES IN 2D
+        bool        raster;
+
+        // MAX ADAPTIVE TILE MESH ERROR (METERS)
+        double      meshError;
+
+        // MEMORY BUDGET FOR MAPS (MB)
+        uint32_t    memory;
+
+        // LOAD ALL MAPS AT STARTUP WHEN THEY FIT THE BUDGET
+        bool        preload;
     } options;
 
     struct Local
     {
+        // Guards tile swaps and clipmap updates between the loader and the drawer
+        mutex           tileLock;
+
+        // Bumped on every view change, the loader sleeps until it moves
+        mutex               viewLock;
+        condition_variable  viewChanged;
+        atomic<uint64_t>    viewVersion;
+
         Tile            tile[9];
 
-        uint32_t        gridSize[DETAIL_LEVELS];
         uint32_t        tileSize[DETAIL_LEVELS];
-        unordered_map<int16_t, unordered_map<int16_t, hgt::Map> > world;
+        uint32_t        clipmapSize[CLIPMAP_FULL + 1];
+
+        // Height layers allocated, set once the drawer has created them
+        atomic<uint32_t>    layers;
+
+        // Adaptive mesh index ranges by height layer and level, none where the
+        // grid level is no more triangles
+        vector<uint32_t>    meshFirst;
+        vector<uint32_t>    meshSize;
+
+        hgt::World      world;
+
+        // Clipmap levels as uploaded: world grid index of each level's first
+        // vertex and the finest level drawn
+        struct Clipmap
+        {
+            glm::ivec2  origin[CLIPMAP_LEVELS];
+            uint8_t     first;
+            bool        ready;
+            GLsync      fence;
+        } clipmap;
 
         struct D2D
         {
@@ -140,18 +187,43 @@ class Engine
         GLFWwindow  *window;
 
         // SHADERS
-        GLuint      program[2][2];
-        GLuint      MVP[2][2];
-        GLuint      BOX[2][2];
+        GLuint      program[2][4];
+        GLuint      MVP[2][4];
+        GLuint      FIRST[2][4];
+        GLuint      LEVEL[2][4];
+        GLuint      LAYER[2][4];
+        GLuint      GRID[2][4];
+        GLuint      EYE[2][4];
+        GLuint      UNPROJECT[2][4];
 
         // INDICES
-        GLuint      gridIndice[DETAIL_LEVELS];
         GLuint      tileIndice[DETAIL_LEVELS];
+        GLuint      clipmapIndice[CLIPMAP_FULL + 1];
+        vector<GLuint>  meshIndice;
 
         // BUFFERS
-        GLuint      buffer[19];
+        GLuint      buffer[4];
+
+        // TEXTURES (tile heights by layer, cos/sin of rows and columns by tile)
+        GLuint      heights;
+        GLuint      trig;
+
+        // TEXTURES (clipmap heights and cos/sin of rows and columns by level)
+        GLuint      clipmapHeights;
+        GLuint      clipmapTrig;
+
+        // SYNC (last frame drawn from the tile buffers)
+        GLsync      drawn;
     } gl;
 
+    struct Registered
+    {
+        char        filename[1024];
+        int32_t     lat;
+        int32_t     lon;
+        double      time;
+    }; // struct Registered
+
     public:
         Engine(Log &_debug);
         ~Engine(void);
@@ -160,8 +232,9 @@ class Engine
         void terminate(void);
 
     private:
-        void loadMap(const char *path);
-        void parseMapFilename(char *path, char *&filename, int32_t &lat, int32_t &lon);
+        void loadMaps(int count, char **paths);
+        void registerMap(const char *path, char *filename, int32_t &lat, int32_t &lon);
+        void registerArchive(const char *path, vector<Registered> &registered);
 
         void updateViewport(void);
         void updateViewport2D(void);
@@ -169,6 +242,8 @@ class Engine
 
         void updateView(void);
         void updateView2D(void);
+        void notifyView(void);
+        void waitView(uint64_t &version);
         void updateView3D(void);
 
         void changeViewType(void);
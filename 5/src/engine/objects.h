@@ -62,11 +62,15 @@ struct Tile
 
     bool        valid;
     glm::vec4   box;
-    GLuint      buffer;
+    uint32_t    layer;
     uint32_t    size;
     uint8_t     order;
+    uint8_t     detail;
+    glm::vec2   heights;    // min, max as drawn (biased)
+    float       errors[DETAIL_LEVELS];  // max height deviation of each grid level (meters)
+    GLsync      fence;
 
-    Tile(uint64_t _id = 0, bool _valid = false, glm::dvec4 _box = glm::dvec4(), uint32_t _buffer = 0, uint32_t _size = 0, uint8_t _order = 0);
+    Tile(uint64_t _id = 0, bool _valid = false, glm::dvec4 _box = glm::dvec4(), uint32_t _layer = 0, uint32_t _size = 0, uint8_t _order = 0);
 }; // struct Tile
 
 inline
@@ -137,12 +141,16 @@ TerrainPoint::TerrainPoint(uint16_t _height/* = 0*/)
 }
 
 inline
-Tile::Tile(uint64_t _id/*= 0*/, bool _valid/* = false*/, glm::dvec4 _box/* = glm::dvec4()*/, uint32_t _buffer/* = 0*/, uint32_t _size/* = 0*/, uint8_t _order/* = 0*/)
+Tile::Tile(uint64_t _id/*= 0*/, bool _valid/* = false*/, glm::dvec4 _box/* = glm::dvec4()*/, uint32_t _layer/* = 0*/, uint32_t _size/* = 0*/, uint8_t _order/* = 0*/)
 :valid(_valid)
 ,box(_box)
-,buffer(_buffer)
+,layer(_layer)
 ,size(_size)
 ,order(_order)
+,detail(0)
+,heights()
+,errors()
+,fence(nullptr)
 {
     id.d = _id;
 }
@@ -0,0 +1,204 @@
+#ifndef __HGT_ARCHIVE_H__
+#define __HGT_ARCHIVE_H__
+
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+#include <vector>
+
+#include "hgt/file.h"
+
+namespace terrain
+{
+
+namespace hgt
+{
+
+/*
+ * Packed map archive (.hgta, written by the packer tool):
+ *  ArchiveHeader
+ *  ArchiveEntry[count]     sorted by (lat, lon)
+ *  tile payloads           FILE_SIZE each, ARCHIVE_ALIGNMENT aligned, either
+ *                          big-endian as in .hgt files or already converted
+ *                          (ARCHIVE_CONVERTED)
+ */
+static const char       ARCHIVE_MAGIC[4]    = {'H', 'G', 'T', 'A'};
+static const uint32_t   ARCHIVE_VERSION     = 1;
+static const uint32_t   ARCHIVE_ALIGNMENT   = 4096;
+static const uint32_t   ARCHIVE_CONVERTED   = 1;
+
+struct ArchiveHeader
+{
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    flags;
+    uint32_t    count;
+    int16_t     minLat;
+    int16_t     maxLat;
+    int16_t     minLon;
+    int16_t     maxLon;
+}; // struct ArchiveHeader
+
+struct ArchiveEntry
+{
+    int16_t     lat;
+    int16_t     lon;
+    uint32_t    reserved;
+    uint64_t    offset;
+}; // struct ArchiveEntry
+
+inline
+bool operator<(const ArchiveEntry &first, const ArchiveEntry &second)
+{
+    return first.lat < second.lat || (first.lat == second.lat && first.lon < second.lon);
+}
+
+inline
+uint64_t archiveAlign(uint64_t offset)
+{
+    return (offset + ARCHIVE_ALIGNMENT - 1) / ARCHIVE_ALIGNMENT * ARCHIVE_ALIGNMENT;
+}
+
+// Whole archive mapped once, read only and without reserving any memory for
+// it, tiles are paged in from the file when touched and can always be
+// dropped back to it. Big-endian payloads are converted into the maps' own
+// memory instead.
+class Archive
+{
+    const uint8_t       *data;
+    size_t              size;
+    size_t              page;
+    const ArchiveHeader *header;
+    const ArchiveEntry  *index;
+
+    public:
+        Archive(const char *filename);
+        ~Archive(void);
+
+        const ArchiveHeader &getHeader(void) const;
+        const ArchiveEntry &getEntry(uint32_t e) const;
+        bool isConverted(void) const;
+
+        const int16_t *find(int16_t lat, int16_t lon) const;
+        void drop(const int16_t *samples) const;
+
+    private:
+        bool isValid(void) const;
+}; // class Archive
+
+inline
+Archive::Archive(const char *filename)
+:data(nullptr)
+,size(0)
+,page(sysconf(_SC_PAGESIZE))
+,header(nullptr)
+,index(nullptr)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1)
+        throw runtime_error("Couldn't open map archive!");
+
+    struct stat info;
+    if(fstat(fd, &info) == -1 || (size_t) info.st_size < sizeof(ArchiveHeader))
+    {
+        close(fd);
+        throw runtime_error("Invalid map archive size!");
+    }
+
+    size = info.st_size;
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED)
+        throw runtime_error("Couldn't map map archive!");
+
+    madvise(mapped, size, MADV_RANDOM);
+    data    = (const uint8_t *) mapped;
+    header  = (const ArchiveHeader *) data;
+    index   = (const ArchiveEntry *) (data + sizeof(ArchiveHeader));
+    if(!isValid())
+    {
+        munmap(mapped, size);
+        throw runtime_error("Invalid map archive!");
+    }
+}
+
+inline
+Archive::~Archive(void)
+{
+    munmap((void *) data, size);
+}
+
+inline
+const ArchiveHeader &Archive::getHeader(void) const
+{
+    return *header;
+}
+
+inline
+const ArchiveEntry &Archive::getEntry(uint32_t e) const
+{
+    assert(e < header->count);
+    return index[e];
+}
+
+inline
+bool Archive::isConverted(void) const
+{
+    return header->flags & ARCHIVE_CONVERTED;
+}
+
+inline
+const int16_t *Archive::find(int16_t lat, int16_t lon) const
+{
+    ArchiveEntry search = {lat, lon, 0, 0};
+    const ArchiveEntry *entry = std::lower_bound(index, index + header->count, search);
+    if(entry == index + header->count || entry->lat != lat || entry->lon != lon)
+        return nullptr;
+
+    return (const int16_t *) (data + entry->offset);
+}
+
+// Releases the tile pages, they are read back from the file when touched
+// again. Pages larger than the alignment are shared with the neighbours,
+// which are left alone then.
+inline
+void Archive::drop(const int16_t *samples) const
+{
+    if(!(ARCHIVE_ALIGNMENT % page))
+        madvise((void *) samples, archiveAlign(FILE_SIZE), MADV_DONTNEED);
+}
+
+// Header, then entries sorted by (lat, lon) with aligned payloads in the
+// same order, none overlapping the index, each other or the end of the file
+inline
+bool Archive::isValid(void) const
+{
+    if(memcmp(header->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) || header->version != ARCHIVE_VERSION
+    || (size - sizeof(ArchiveHeader)) / sizeof(ArchiveEntry) < header->count)
+        return false;
+
+    uint64_t end = sizeof(ArchiveHeader) + (uint64_t) header->count * sizeof(ArchiveEntry);
+    for(uint32_t e = 0; e < header->count; ++ e)
+    {
+        const ArchiveEntry &entry = index[e];
+        if((e && !(index[e - 1] < entry)) || entry.offset % ARCHIVE_ALIGNMENT || entry.offset < end
+        || entry.offset > size || size - entry.offset < FILE_SIZE)
+            return false;
+
+        end = entry.offset + FILE_SIZE;
+    }
+
+    return true;
+}
+
+} // namespace hgt
+
+} // namespace terrain
+
+#endif // __HGT_ARCHIVE_H__
@@ -0,0 +1,114 @@
+#ifndef __HGT_CONVERT_H__
+#define __HGT_CONVERT_H__
+
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define HGT_CONVERT_X86 true
+#endif // __x86_64__ || __i386__
+
+namespace terrain
+{
+
+namespace hgt
+{
+
+// Big-endian SRTM samples -> native biased samples (+1000, void = 0).
+// Source and destination may be the same buffer.
+typedef void (*Converter)(int16_t *dst, const int16_t *src, size_t count);
+
+inline
+void convertScalar(int16_t *dst, const int16_t *src, size_t count)
+{
+    for(size_t s = 0; s < count; ++ s)
+    {
+        int16_t word = __builtin_bswap16(src[s]);
+        dst[s] = word == -32768 ? 0 : word + 1000;
+    }
+}
+
+#ifdef HGT_CONVERT_X86
+__attribute__((target("sse2")))
+inline
+void convertSSE2(int16_t *dst, const int16_t *src, size_t count)
+{
+    const __m128i bias = _mm_set1_epi16(1000);
+    const __m128i none = _mm_set1_epi16(-32768);
+
+    size_t s = 0;
+    for(; s + 8 <= count; s += 8)
+    {
+        __m128i word = _mm_loadu_si128((const __m128i *) (src + s));
+        word = _mm_or_si128(_mm_slli_epi16(word, 8), _mm_srli_epi16(word, 8));
+        word = _mm_andnot_si128(_mm_cmpeq_epi16(word, none), _mm_add_epi16(word, bias));
+        _mm_storeu_si128((__m128i *) (dst + s), word);
+    }
+
+    convertScalar(dst + s, src + s, count - s);
+}
+
+__attribute__((target("avx2")))
+inline
+void convertAVX2(int16_t *dst, const int16_t *src, size_t count)
+{
+    const __m256i bias = _mm256_set1_epi16(1000);
+    const __m256i none = _mm256_set1_epi16(-32768);
+    const __m256i swap = _mm256_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+    size_t s = 0;
+    for(; s + 16 <= count; s += 16)
+    {
+        __m256i word = _mm256_loadu_si256((const __m256i *) (src + s));
+        word = _mm256_shuffle_epi8(word, swap);
+        word = _mm256_andnot_si256(_mm256_cmpeq_epi16(word, none), _mm256_add_epi16(word, bias));
+        _mm256_storeu_si256((__m256i *) (dst + s), word);
+    }
+
+    convertScalar(dst + s, src + s, count - s);
+}
+#endif // HGT_CONVERT_X86
+
+// Picks the widest kernel supported by the running CPU
+inline
+Converter converter(const char **name = nullptr)
+{
+    const char *_name       = "scalar";
+    Converter   kernel      = convertScalar;
+
+#ifdef HGT_CONVERT_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        _name   = "AVX2";
+        kernel  = convertAVX2;
+    }
+
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        _name   = "SSE2";
+        kernel  = convertSSE2;
+    }
+#endif // HGT_CONVERT_X86
+
+    if(name)
+        *name = _name;
+
+    return kernel;
+}
+
+inline
+void convert(int16_t *dst, const int16_t *src, size_t count)
+{
+    static const Converter kernel = converter();
+    kernel(dst, src, count);
+}
+
+} // namespace hgt
+
+} // namespace terrain
+
+#endif // __HGT_CONVERT_H__
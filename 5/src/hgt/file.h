@@ -2,7 +2,11 @@
 #define __HGT_FILE_H__
 
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstdint>
@@ -14,54 +18,129 @@ namespace terrain
 namespace hgt
 {
 
+static const uint32_t   SAMPLES     = 1201;
+static const size_t     FILE_SIZE   = SAMPLES * SAMPLES * sizeof(int16_t);
+
+// Big-endian SRTM3 samples mapped straight from disk. The mapping is private
+// and writable, so the owner can convert it in place (see Map::load) without
+// touching the file.
 class File
 {
-    int8_t data[1201][1201][2];
+    int16_t *data;
 
     public:
         File(const char *filename);
+        ~File(void);
+
         int16_t get(int x, int y);
+        const int16_t *getData(void) const;
+        int16_t *release(void);
 }; // class File
 
 inline
 File::File(const char *filename)
-:data()
+:data(nullptr)
 {
     int fd = open(filename, O_RDONLY);
     if(fd == -1)
         throw runtime_error("Couldn't open map file!");
 
-    if(read(fd, this, sizeof(File)) != sizeof(File))
+    struct stat info;
+    if(fstat(fd, &info) == -1 || (size_t) info.st_size != FILE_SIZE)
     {
         close(fd);
-        throw runtime_error("Couldn't read map data!");
+        throw runtime_error("Invalid map file size!");
     }
 
+    void *mapped = mmap(nullptr, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
     close(fd);
+    if(mapped == MAP_FAILED)
+        throw runtime_error("Couldn't map map data!");
+
+    madvise(mapped, FILE_SIZE, MADV_SEQUENTIAL);
+    data = (int16_t *) mapped;
+}
+
+inline
+File::~File(void)
+{
+    if(data)
+        munmap(data, FILE_SIZE);
 }
 
 inline
 int16_t File::get(int x, int y)
 {
     y = 1200 - y;
+    assert(data);
     assert(0 <= x && x <= 1200 && 0 <= y && y <= 1200);
-    union
-    {
-        int16_t word;
-        struct
-        {
-            int8_t byte1;
-            int8_t byte2;
-        };
-    } conv;
-
-    conv.byte1 = data[y][x][1];
-    conv.byte2 = data[y][x][0];
-    if(conv.word == -32768)
+    int16_t word = __builtin_bswap16(data[y * SAMPLES + x]);
+    if(word == -32768)
         return -1000;
 
-    assert(-1000 <= conv.word && conv.word <= 9000);
-    return conv.word;
+    assert(-1000 <= word && word <= 9000);
+    return word;
+}
+
+inline
+const int16_t *File::getData(void) const
+{
+    return data;
+}
+
+inline
+int16_t *File::release(void)
+{
+    int16_t *mapped = data;
+    data = nullptr;
+    return mapped;
+}
+
+// Splits (modifies) path, reads square coordinates from N00E000.hgt like name
+inline
+void parseFilename(char *path, char *&filename, int32_t &lat, int32_t &lon)
+{
+    char *extension = nullptr,
+         nPos[2]    = {},
+         nDeg[4]    = {},
+         wPos[2]    = {},
+         wDeg[4]    = {};
+
+    filename = basename(path);
+    if(!(extension = strrchr(filename, '.')) || strcmp(extension + 1, "hgt"))
+        throw runtime_error("Invalid map file type");
+
+    *extension = 0;
+    sscanf(filename, "%1[nNsS]%3[0123456789]%1[wWeE]%3[0123456789]", nPos, nDeg, wPos, wDeg);
+    sscanf(nDeg, "%d", &lat);
+    sscanf(wDeg, "%d", &lon);
+    switch(tolower(nPos[0]))
+    {
+        case 's':
+            lat *= -1;
+            break;
+
+        case 'n':
+            break;
+
+        default:
+            throw runtime_error("Invalid map file name");
+            break;
+    }
+
+    switch(tolower(wPos[0]))
+    {
+        case 'w':
+            lon *= -1;
+            break;
+
+        case 'e':
+            break;
+
+        default:
+            throw runtime_error("Invalid map file name");
+            break;
+    }
 }
 
 } // namespace hgt
@@ -3,10 +3,17 @@
 
 #include <cstdlib>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstdint>
 #include <cassert>
+#include <utility>
+#include <memory>
+
+#include "hgt/file.h"
+#include "hgt/convert.h"
+#include "hgt/archive.h"
 
 namespace terrain
 {
@@ -14,34 +21,214 @@ namespace terrain
 namespace hgt
 {
 
+// Detail levels: 1201, 601, 301, 151 and 76 samples per side, each one
+// sharing the corner samples with the finer level.
+static const uint32_t   LEVELS      = 5;
+
+constexpr uint32_t levelSamples(uint32_t level)
+{
+    return level ? (levelSamples(level - 1) - 1) / 2 + 1 : SAMPLES;
+}
+
+constexpr size_t pyramidSamples(uint32_t level = 1)
+{
+    return level < LEVELS ? levelSamples(level) * levelSamples(level) + pyramidSamples(level + 1) : 0;
+}
+
+static const size_t     MAP_SIZE    = FILE_SIZE + pyramidSamples() * sizeof(int16_t);
+
+// Biased (+1000, void = 0) samples kept in the file row order (north first).
+// The data is the private mapping taken over from hgt::File and converted in
+// place, a read only view into a converted archive, or a converted copy of a
+// big-endian archive tile, so loading a tile costs a single pass. Coarser
+// levels are filtered down into a separate pyramid.
 class Map
 {
-    int16_t data[1201][1201];
+    int16_t *data;
+    std::shared_ptr<Archive> archive;
+    int16_t *copy;
+    int16_t *pyramid;
+    int16_t *level[LEVELS];
 
     public:
         Map(void);
+        Map(const Map &map) = delete;
+        Map(Map &&map);
+        ~Map(void);
+
+        Map &operator=(const Map &map) = delete;
+        Map &operator=(Map &&map);
+
+        void load(File &file);
+        void view(const std::shared_ptr<Archive> &_archive, const int16_t *samples);
         int16_t &get(int x, int y);
+        int16_t get(int x, int y, int l);
         void set(int x, int y, int16_t value);
+
+    private:
+        void release(void);
+        void buildPyramid(void);
 }; // class Map
 
 inline
 Map::Map(void)
-:data()
+:data(nullptr)
+,archive()
+,copy(nullptr)
+,pyramid(nullptr)
+,level()
+{
+}
+
+inline
+Map::Map(Map &&map)
+:data(map.data)
+,archive(std::move(map.archive))
+,copy(map.copy)
+,pyramid(map.pyramid)
+,level()
+{
+    std::swap(level, map.level);
+    map.data    = nullptr;
+    map.copy    = nullptr;
+    map.pyramid = nullptr;
+}
+
+inline
+Map::~Map(void)
 {
+    release();
+}
+
+inline
+Map &Map::operator=(Map &&map)
+{
+    std::swap(data, map.data);
+    std::swap(archive, map.archive);
+    std::swap(copy, map.copy);
+    std::swap(pyramid, map.pyramid);
+    std::swap(level, map.level);
+    return *this;
+}
+
+inline
+void Map::load(File &file)
+{
+    release();
+    data = file.release();
+    convert(data, data, SAMPLES * SAMPLES);
+    buildPyramid();
+}
+
+// The archive stays mapped read only, big-endian tiles are converted out of
+// it and their pages dropped right away
+inline
+void Map::view(const std::shared_ptr<Archive> &_archive, const int16_t *samples)
+{
+    release();
+    if(_archive->isConverted())
+    {
+        data    = const_cast<int16_t *>(samples);
+        archive = _archive;
+    }
+
+    else
+    {
+        copy    = new int16_t[SAMPLES * SAMPLES];
+        data    = copy;
+        convert(data, samples, SAMPLES * SAMPLES);
+        _archive->drop(samples);
+    }
+
+    buildPyramid();
 }
 
 inline
 int16_t &Map::get(int x, int y)
 {
+    assert(data);
     assert(0 <= x && x <= 1200 && 0 <= y && y <= 1200);
-    return data[y][x];
+    return data[(1200 - y) * SAMPLES + x];
+}
+
+inline
+int16_t Map::get(int x, int y, int l)
+{
+    assert(0 <= l && l < (int) LEVELS && level[l]);
+    const int samples = levelSamples(l);
+    assert(0 <= x && x < samples && 0 <= y && y < samples);
+    return level[l][(samples - 1 - y) * samples + x];
 }
 
 inline
 void Map::set(int x, int y, int16_t value)
 {
+    assert(data && !archive);
     assert(0 <= x && x <= 1200 && 0 <= y && y <= 1200);
-    data[y][x] = value;
+    data[(1200 - y) * SAMPLES + x] = value;
+}
+
+inline
+void Map::release(void)
+{
+    if(archive)
+        archive->drop(data);
+
+    else if(data && !copy)
+        munmap(data, FILE_SIZE);
+
+    delete[] copy;
+    delete[] pyramid;
+    data    = nullptr;
+    archive.reset();
+    copy    = nullptr;
+    pyramid = nullptr;
+    for(uint32_t l = 0; l < LEVELS; ++ l)
+        level[l] = nullptr;
+}
+
+inline
+void Map::buildPyramid(void)
+{
+    pyramid     = new int16_t[pyramidSamples()];
+    level[0]    = data;
+    level[1]    = pyramid;
+    for(uint32_t l = 1; l < LEVELS; ++ l)
+    {
+        if(l + 1 < LEVELS)
+            level[l + 1] = level[l] + levelSamples(l) * levelSamples(l);
+
+        // 3x3 tent filter around the matching finer sample, voids skipped
+        const uint32_t  samples = levelSamples(l);
+        const int32_t   finer   = levelSamples(l - 1);
+        const int16_t   *source = level[l - 1];
+        int16_t         *target = level[l];
+        for(uint32_t y = 0; y < samples; ++ y)
+            for(uint32_t x = 0; x < samples; ++ x)
+            {
+                // Filter clipped to the finer level at its borders
+                const int32_t   dyMin   = y ? -1 : 0;
+                const int32_t   dyMax   = y + 1 < samples ? 1 : 0;
+                const int32_t   dxMin   = x ? -1 : 0;
+                const int32_t   dxMax   = x + 1 < samples ? 1 : 0;
+                const int16_t   *center = source + 2 * (y * finer + x);
+                int32_t         sum     = 0;
+                int32_t         weight  = 0;
+                for(int32_t dy = dyMin; dy <= dyMax; ++ dy)
+                    for(int32_t dx = dxMin; dx <= dxMax; ++ dx)
+                    {
+                        const int16_t sample = center[dy * finer + dx];
+                        if(!sample)
+                            continue;
+
+                        const int32_t w = (2 - abs(dy)) * (2 - abs(dx));
+                        sum     += w * sample;
+                        weight  += w;
+                    }
+
+                target[y * samples + x] = weight ? (sum + weight / 2) / weight : 0;
+            }
+    }
 }
 
 } // namespace hgt
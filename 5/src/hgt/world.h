@@ -0,0 +1,291 @@
+#ifndef __HGT_WORLD_H__
+#define __HGT_WORLD_H__
+
+#include <cstdint>
+#include <cassert>
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <atomic>
+#include <unordered_map>
+
+#include "libs/logger/logger.h"
+
+#include "hgt/file.h"
+#include "hgt/map.h"
+#include "hgt/archive.h"
+
+namespace terrain
+{
+
+namespace hgt
+{
+
+// Registry of all known map tiles, loose files and archives. Tiles are
+// loaded when first requested and the least recently used ones are dropped
+// when over the memory budget. Dropped tiles may still be in use elsewhere,
+// they are handed back when requested again, so a tile never has more than
+// one Map and its pages are only released with the last user. Tiles that
+// fail to load are logged once and treated as missing from then on.
+class World
+{
+    struct Entry
+    {
+        std::string                     path;
+        std::shared_ptr<Archive>        archive;
+        const int16_t                   *samples;
+        bool                            loading;
+        bool                            missing;
+        std::shared_ptr<Map>            map;
+        std::weak_ptr<Map>              alive;
+        std::list<int32_t>::iterator    used;
+    }; // struct Entry
+
+    std::unique_ptr<Logger>             log;
+    std::mutex                          lock;
+    std::condition_variable             loaded;
+    std::unordered_map<int32_t, Entry>  tiles;
+    std::vector<std::shared_ptr<Archive> > archives;
+    std::list<int32_t>                  used;
+    size_t                              budget;
+    size_t                              resident;
+
+    std::atomic<uint64_t>               hits;
+    std::atomic<uint64_t>               misses;
+    std::atomic<uint64_t>               evictions;
+
+    public:
+        World(size_t _budget = 0);
+
+        void setLog(Log &_log);
+        void setBudget(size_t _budget);
+        bool add(int16_t lat, int16_t lon, const char *path);
+        void add(const std::shared_ptr<Archive> &archive);
+        std::shared_ptr<Map> get(int16_t lat, int16_t lon);
+        bool has(int16_t lat, int16_t lon);
+
+        size_t getResident(void);
+        uint64_t getHits(void) const;
+        uint64_t getMisses(void) const;
+        uint64_t getEvictions(void) const;
+
+    private:
+        static int32_t key(int16_t lat, int16_t lon);
+        Entry *find(int16_t lat, int16_t lon);
+        void evict(void);
+}; // class World
+
+inline
+World::World(size_t _budget/* = 0*/)
+:log()
+,lock()
+,loaded()
+,tiles()
+,archives()
+,used()
+,budget(_budget)
+,resident(0)
+,hits(0)
+,misses(0)
+,evictions(0)
+{
+}
+
+inline
+void World::setLog(Log &_log)
+{
+    log.reset(new Logger(_log, "WORLD"));
+}
+
+inline
+void World::setBudget(size_t _budget)
+{
+    std::lock_guard<std::mutex> _lock(lock);
+    budget = _budget;
+    evict();
+}
+
+inline
+bool World::add(int16_t lat, int16_t lon, const char *path)
+{
+    std::lock_guard<std::mutex> _lock(lock);
+    Entry &entry = tiles[key(lat, lon)];
+    if(!entry.path.empty())
+        return false;
+
+    entry.path      = path;
+    entry.archive.reset();
+    entry.samples   = nullptr;
+    entry.loading   = false;
+    entry.missing   = false;
+    entry.used      = used.end();
+    return true;
+}
+
+// Archive tiles are only looked up when requested, loose files take priority
+inline
+void World::add(const std::shared_ptr<Archive> &archive)
+{
+    std::lock_guard<std::mutex> _lock(lock);
+    archives.push_back(archive);
+}
+
+inline
+std::shared_ptr<Map> World::get(int16_t lat, int16_t lon)
+{
+    std::unique_lock<std::mutex> _lock(lock);
+    Entry *entry = find(lat, lon);
+    if(!entry)
+        return nullptr;
+
+    // Only one thread converts a tile, the others wait for it
+    loaded.wait(_lock, [entry]{return !entry->loading;});
+    if(entry->missing)
+        return nullptr;
+
+    if(entry->map)
+    {
+        ++ hits;
+        used.splice(used.begin(), used, entry->used);
+        return entry->map;
+    }
+
+    // Evicted while still in use, resident again
+    if((entry->map = entry->alive.lock()))
+    {
+        ++ hits;
+        used.push_front(key(lat, lon));
+        entry->used = used.begin();
+        resident    += MAP_SIZE;
+        evict();
+        return entry->map;
+    }
+
+    // Load without holding the lock, other tiles stay available meanwhile
+    ++ misses;
+    entry->loading = true;
+    _lock.unlock();
+
+    std::shared_ptr<Map> map = std::make_shared<Map>();
+    try
+    {
+        if(entry->archive)
+            map->view(entry->archive, entry->samples);
+
+        else
+        {
+            File file(entry->path.c_str());
+            map->load(file);
+        }
+    }
+    catch(const exception &error)
+    {
+        _lock.lock();
+        entry->loading = false;
+        entry->missing = true;
+        loaded.notify_all();
+        if(log)
+            log->warning("Couldn't load (%d %d) square from %s, drawing it without a map: %s", lon, lat,
+                entry->archive ? "archive" : entry->path.c_str(), error.what());
+
+        return nullptr;
+    }
+
+    _lock.lock();
+    entry->loading  = false;
+    entry->map      = map;
+    entry->alive    = map;
+    used.push_front(key(lat, lon));
+    entry->used     = used.begin();
+    resident        += MAP_SIZE;
+    evict();
+    loaded.notify_all();
+    return map;
+}
+
+// Whether there is a map for the square, without loading it
+inline
+bool World::has(int16_t lat, int16_t lon)
+{
+    std::lock_guard<std::mutex> _lock(lock);
+    return find(lat, lon);
+}
+
+inline
+size_t World::getResident(void)
+{
+    std::lock_guard<std::mutex> _lock(lock);
+    return resident;
+}
+
+inline
+uint64_t World::getHits(void) const
+{
+    return hits;
+}
+
+inline
+uint64_t World::getMisses(void) const
+{
+    return misses;
+}
+
+inline
+uint64_t World::getEvictions(void) const
+{
+    return evictions;
+}
+
+inline
+int32_t World::key(int16_t lat, int16_t lon)
+{
+    return (int32_t) lat << 16 | (uint16_t) lon;
+}
+
+inline
+World::Entry *World::find(int16_t lat, int16_t lon)
+{
+    const int32_t _key = key(lat, lon);
+    auto tile = tiles.find(_key);
+    if(tile != tiles.end())
+        return tile->second.missing ? nullptr : &tile->second;
+
+    for(const std::shared_ptr<Archive> &archive: archives)
+        if(const int16_t *samples = archive->find(lat, lon))
+        {
+            Entry &entry    = tiles[_key];
+            entry.archive   = archive;
+            entry.samples   = samples;
+            entry.loading   = false;
+            entry.missing   = false;
+            entry.used      = used.end();
+            return &entry;
+        }
+
+    return nullptr;
+}
+
+inline
+void World::evict(void)
+{
+    // Always keep the most recently used tile
+    while(resident > budget && used.size() > 1)
+    {
+        Entry &entry = tiles[used.back()];
+        assert(entry.map);
+        entry.map.reset();
+        entry.used = used.end();
+        used.pop_back();
+        resident -= MAP_SIZE;
+        ++ evictions;
+    }
+}
+
+} // namespace hgt
+
+} // namespace terrain
+
+#endif // __HGT_WORLD_H__
@@ -0,0 +1,49 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <vector>
+
+using namespace std;
+
+class ThreadPool
+{
+    public:
+        ThreadPool(uint32_t _workers = thread::hardware_concurrency());
+        ~ThreadPool(void);
+
+        // Number of threads running jobs (including the caller)
+        uint32_t size(void) const;
+
+        // Runs job(0) .. job(count - 1) on the workers and the calling thread.
+        // Returns when all of them are done, rethrows the first job exception.
+        void run(uint32_t count, const function<void(uint32_t)> &job);
+
+    private:
+        vector<thread>                      workers;
+        mutex                               lock;
+        condition_variable                  wake;
+        condition_variable                  done;
+
+        const function<void(uint32_t)>     *job;
+        atomic<uint32_t>                    next;
+        uint32_t                            count;
+        uint32_t                            finished;
+        uint32_t                            active;
+        uint64_t                            generation;
+        bool                                quit;
+        exception_ptr                       error;
+
+        void work(void);
+        void execute(void);
+}; // class ThreadPool
+
+#include "pool.inl"
+
+#endif // __POOL_H__
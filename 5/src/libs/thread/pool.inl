@@ -0,0 +1,132 @@
+#ifndef __POOL_INL__
+#define __POOL_INL__
+
+#include <cassert>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "pool.h"
+
+#define _inline inline
+
+using namespace std;
+
+// THREADPOOL
+_inline
+ThreadPool::ThreadPool(uint32_t _workers/* = thread::hardware_concurrency()*/)
+:workers()
+,lock()
+,wake()
+,done()
+,job(nullptr)
+,next(0)
+,count(0)
+,finished(0)
+,active(0)
+,generation(0)
+,quit(false)
+,error()
+{
+    for(uint32_t w = 1; w < max(1u, _workers); ++ w)
+        workers.emplace_back(&ThreadPool::work, this);
+}
+
+_inline
+ThreadPool::~ThreadPool(void)
+{
+    {
+        lock_guard<mutex> _lock(lock);
+        quit = true;
+    }
+
+    wake.notify_all();
+    for(thread &worker: workers)
+        worker.join();
+}
+
+_inline
+uint32_t ThreadPool::size(void) const
+{
+    return workers.size() + 1;
+}
+
+_inline
+void ThreadPool::run(uint32_t _count, const function<void(uint32_t)> &_job)
+{
+    if(!_count)
+        return;
+
+    {
+        lock_guard<mutex> _lock(lock);
+        assert(!job && !active);
+        job         = &_job;
+        count       = _count;
+        finished    = 0;
+        error       = nullptr;
+        next        = 0;
+        ++ active;
+        ++ generation;
+    }
+
+    wake.notify_all();
+    execute();
+
+    unique_lock<mutex> _lock(lock);
+    done.wait(_lock, [&]{return !active && finished == count;});
+    job = nullptr;
+    if(error)
+    {
+        exception_ptr _error = error;
+        error = nullptr;
+        rethrow_exception(_error);
+    }
+}
+
+_inline
+void ThreadPool::work(void)
+{
+    uint64_t seen = 0;
+    while(true)
+    {
+        {
+            unique_lock<mutex> _lock(lock);
+            wake.wait(_lock, [&]{return quit || (job && generation != seen);});
+            if(quit)
+                return;
+
+            seen = generation;
+            ++ active;
+        }
+
+        execute();
+    }
+}
+
+_inline
+void ThreadPool::execute(void)
+{
+    uint32_t executed = 0;
+    for(uint32_t j = next ++; j < count; j = next ++, ++ executed)
+    {
+        try
+        {
+            (*job)(j);
+        }
+        catch(...)
+        {
+            lock_guard<mutex> _lock(lock);
+            if(!error)
+                error = current_exception();
+        }
+    }
+
+    lock_guard<mutex> _lock(lock);
+    finished += executed;
+    -- active;
+    if(!active && finished == count)
+        done.notify_all();
+}
+
+#undef _inline
+#endif // __POOL_INL__
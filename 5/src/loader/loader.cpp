@@ -11,6 +11,7 @@
 #include "engine/engine.h"
 #include "engine/objects.h"
 #include "projection/mercator.h"
+#include "projection/batch.h"
 #include "libs/logger/logger.h"
 
 using namespace std;
@@ -18,9 +19,36 @@ using namespace terrain;
 using namespace terrain::loader;
 using namespace terrain::projection;
 
+static const uint32_t   TILE_DENSITY    = (1 << DETAIL_LEVELS) + 1;
+static const uint8_t    COARSE_DETAIL   = 4;
+static const GLsizeiptr TILE_BYTES      = TILE_DENSITY * TILE_DENSITY * sizeof(objects::TerrainPoint);
+
+// Finest clipmap level drawn reaches at least this many altitudes away
+static const double     CLIPMAP_REACH   = 2.5;
+
+// Texel of a world grid index in a clipmap level
+static inline
+int32_t clipmapTexel(int32_t index)
+{
+    return (index % CLIPMAP_SIZE + CLIPMAP_SIZE) % CLIPMAP_SIZE;
+}
+
 Loader::Loader(Log &_log, engine::Engine &_engine)
 :log(_log, "LOADER")
 ,engine(_engine)
+,pool()
+,persistent(false)
+,sync(false)
+,window()
+,windowSize(0)
+,checked(0)
+,cancelled(false)
+,staging()
+,ring()
+,swap()
+,cache()
+,prefetch()
+,clipmap()
 {
 }
 
@@ -42,6 +70,16 @@ void Loader::start(void)
         throw runtime_error("GLEWInit error");
     }
 
+    sync        = GLEW_ARB_sync;
+    persistent  = sync && GLEW_ARB_buffer_storage;
+    if(persistent)
+        setupRing();
+
+    // Tile rows are 1025 samples of 2 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+
+    log.debug("Uploading tiles %s", persistent ? "through persistently mapped staging ring" : "from client memory");
+
     // divisiors of MERCATOR_BOUNDS * 2.0
     int d = 0;
     for(int t = 0; t < TWO_POWER; ++ t)
@@ -61,66 +99,307 @@ void Loader::start(void)
 void Loader::run(void)
 {
     log.debug("Running loader");
-    double lastFrame = 0;
+
+    // Drawer has not created the height layers yet
+    while(state == Thread::STARTED && !engine.local.layers)
+        this_thread::sleep_for(chrono::milliseconds(1000 / LOADER_FPS));
+
+    for(uint32_t t = 0; t < PREFETCH_SLOT; ++ t)
+        swap[t] = ::engine::SWAP_LAYER_1 + t;
+
+    for(uint32_t t = PREFETCH_SLOT; t < STAGING_TILES; ++ t)
+        swap[t] = ::engine::PREFETCH_LAYER_1 + t - PREFETCH_SLOT;
+
+    for(uint32_t l = ::engine::SPARE_LAYER_1; l < engine.local.layers; ++ l)
+        cache.spare.push_back(l);
+
+    cache.limit = engine.local.layers - ::engine::SPARE_LAYER_1;
+    log.debug("Caching up to %u tiles", cache.limit);
+
+    const vector<objects::TerrainPoint> voids(TILE_DENSITY * TILE_DENSITY, objects::TerrainPoint(32768));
+    glBindTexture(GL_TEXTURE_2D_ARRAY, engine.gl.heights);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, ::engine::EMPTY_LAYER, TILE_DENSITY, TILE_DENSITY, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, voids.data());
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    uint64_t version = 0;
     while(state == Thread::STARTED)
     {
-        lastFrame = glfwGetTime();
-        checkTiles();
+        const double    lastFrame   = glfwGetTime();
+        const bool      levels      = engine.options.clipmap && engine.options.viewType == engine::VIEW_3D;
+        const bool      busy        = levels ? updateClipmap() : checkTiles();
         glFlush();
 
-        double currentFrame = glfwGetTime();
-        double diff = currentFrame - lastFrame;
+        const double    diff        = glfwGetTime() - lastFrame;
+        if(diff > 1.0L / (LOADER_FPS - 1))
+            log.warning("Checking %s took: %.4lfs", levels ? "clipmap" : "tiles", diff);
 
-        if(diff < 1.0L / LOADER_FPS)
-            this_thread::sleep_for(chrono::milliseconds(static_cast<uint32_t>(1000.0L / (LOADER_FPS - 1) - diff * 1000.0L)));
-
-        else if(diff > 1.0L / (LOADER_FPS - 1))
-            log.warning("Checking tiles took: %.4lfs", diff);
+        // Nothing left to load or prefetch, sleep until the view changes
+        if(!busy)
+            engine.waitView(version);
     }
 }
 
 void Loader::stop(void)
 {
+    if(persistent)
+        releaseRing();
 }
 
 void Loader::terminate(void)
 {
+    engine.notifyView();
 }
 
+// Returns whether there may be more work without a view change
 inline
-void Loader::checkTiles(void)
+bool Loader::checkTiles(void)
 {
-    if(!engine.gl.buffer[::engine::SWAP_BUFFER_1])
-        return;
+    const uint64_t      version = engine.local.viewVersion;
+    const glm::dvec4    view    = engine.getBoundingRect();
+    updateMotion(view);
 
     uint32_t tileSize = 0;
-    objects::Tile::ID _id = getFirstTile(tileSize);
+    objects::Tile::ID _id = getFirstTile(view, tileSize);
     markInvalidTiles(_id, tileSize);
+    window.d    = _id.d;
+    windowSize  = tileSize;
+    checked     = version;
 
+    uint8_t     pending[9];
+    uint8_t     cached[9];
+    uint32_t    count   = 0;
+    uint32_t    hits    = 0;
+    uint32_t    empty   = 0;
     for(int t = 0; t < 9; ++ t)
         if(!engine.local.tile[t].valid)
         {
             objects::Tile::ID __id;
             __id.h = _id.h + engine.local.tile[t].order / 3;
             __id.w = _id.w + engine.local.tile[t].order % 3;
-            if(!loadTile(t, __id, tileSize))
-                return;
+            placeTile(t, __id, tileSize);
+
+            // Nothing to generate nor upload, swapped in like a cached tile
+            if(isEmpty(t))
+            {
+                staging[t].cached   = true;
+                staging[t].layer    = ::engine::EMPTY_LAYER;
+                staging[t].heights  = glm::vec2();
+                fill(staging[t].errors, staging[t].errors + DETAIL_LEVELS, 0.0f);
+                cached[hits ++]     = t;
+                ++ empty;
+            }
+
+            else if((staging[t].cached = takeCached(tileSize, __id.d, staging[t].layer, staging[t].heights, staging[t].errors)))
+                cached[hits ++] = t;
+
+            // Missing tiles are covered with a coarse version first
+            else
+            {
+                prepareTile(t, COARSE_DETAIL);
+                pending[count ++] = t;
+            }
         }
 
-    for(int t = 0; t < 9; ++ t)
-        if(!engine.local.tile[t].valid)
+    // Then refined to full density once the whole view is covered
+    if(!count && !hits)
+        for(int t = 0; t < 9; ++ t)
+            if(engine.local.tile[t].detail)
+            {
+                placeTile(t, engine.local.tile[t].id, tileSize);
+                prepareTile(t, 0);
+                pending[count ++] = t;
+            }
+
+    // View is complete, spare time goes to tiles it is heading to
+    if(!count && !hits)
+        return prefetchTiles(_id, tileSize);
+
+    if(empty)
+        log.debug("%u of %u tiles swapped in have no maps, drawn flat", empty, hits + count);
+
+    log.debug("Tile cache: %u tiles (%.2lf MB), hits: %lu, misses: %lu, evictions: %lu, prefetch hit rate: %.2lf%% (%lu of %lu)",
+        (uint32_t) cache.tiles.size(), cache.tiles.size() * TILE_BYTES / 1048576.0, cache.hits, cache.misses, cache.evictions,
+        prefetch.issued ? 100.0 * prefetch.used / prefetch.issued : 0.0, prefetch.used, prefetch.issued);
+
+    // Centre tile first, then its neighbours by distance to the view centre
+    const glm::dvec2 center((view.x + view.y) / 2.0, (view.z + view.w) / 2.0);
+    double distance[9];
+    for(uint32_t p = 0; p < count; ++ p)
+        distance[p] = glm::distance(center, glm::dvec2((staging[pending[p]].box.x + staging[pending[p]].box.y) / 2.0, (staging[pending[p]].box.z + staging[pending[p]].box.w) / 2.0));
+
+    for(uint32_t i = 1; i < count; ++ i)
+        for(uint32_t j = i; j > 0 && distance[j - 1] > distance[j]; -- j)
         {
-            objects::Tile::ID __id;
-            __id.h = _id.h + engine.local.tile[t].order / 3;
-            __id.w = _id.w + engine.local.tile[t].order % 3;
-            if(!swapTile(engine.local.tile[t], __id, tileSize, t))
-                return;
+            std::swap(pending[j - 1], pending[j]);
+            std::swap(distance[j - 1], distance[j]);
+        }
+
+    // Tiles finished before the view moved elsewhere are still swapped in
+    const uint32_t requested = count;
+    if(count && !generateTiles(pending, count))
+        log.debug("View changed, dropped %u of %u tiles", requested - count, requested);
+
+    if(count)
+        log.debug("Maps: %zu resident (%.2lf MB), hits: %lu, misses: %lu, evictions: %lu",
+            engine.local.world.getResident() / hgt::MAP_SIZE, engine.local.world.getResident() / 1048576.0,
+            engine.local.world.getHits(), engine.local.world.getMisses(), engine.local.world.getEvictions());
+
+    swapTiles(cached, hits, pending, count);
+    return true;
+}
+
+// Resampling runs on the pool without any GL calls, this thread only uploads.
+// Unfinished tiles are dropped from pending when the window goes stale.
+inline
+bool Loader::generateTiles(uint8_t *pending, uint32_t &count)
+{
+    const double start = glfwGetTime();
+    cancelled = false;
+    for(uint32_t p = 0; p < count; ++ p)
+        staging[pending[p]].done = 0;
+
+    pool.run(count * TILE_BANDS, [&](uint32_t job)
+    {
+        if(isStale())
+            return;
+
+        generateTile(pending[job / TILE_BANDS], job % TILE_BANDS);
+        ++ staging[pending[job / TILE_BANDS]].done;
+    });
+
+    uint32_t finished   = 0;
+    uint32_t partial    = 0;
+    for(uint32_t p = 0; p < count; ++ p)
+        if(staging[pending[p]].done == TILE_BANDS)
+        {
+            Staging &tile = staging[pending[p]];
+            tile.heights = tile.bands[0];
+            uint32_t voids = tile.voids[0];
+            for(uint32_t b = 1; b < TILE_BANDS; ++ b)
+            {
+                tile.heights = glm::vec2(min(tile.heights.x, tile.bands[b].x), max(tile.heights.y, tile.bands[b].y));
+                voids += tile.voids[b];
+            }
+
+            partial += voids > 0;
+            pending[finished ++] = pending[p];
+        }
+
+    log.debug("Generated %u of %u tiles (%u partially without maps) in %.4lfs on %u threads", finished, count, partial, glfwGetTime() - start, pool.size());
+    count = finished;
+
+    const double meshing = glfwGetTime();
+    pool.run(count, [&](uint32_t job)
+    {
+        measureTile(pending[job]);
+        meshTile(pending[job]);
+    });
+
+    // Finest level as drawn, by its mesh or by the grid where that is cheaper
+    uint32_t    meshed      = 0;
+    uint32_t    ranges      = 0;
+    uint64_t    triangles   = 0;
+    for(uint32_t p = 0; p < count; ++ p)
+        if(staging[pending[p]].meshed)
+        {
+            const Staging &tile = staging[pending[p]];
+            ++ meshed;
+            ranges      += DETAIL_LEVELS - count_if(tile.meshSize, tile.meshSize + DETAIL_LEVELS, [](uint32_t size) {return !size;});
+            triangles   += (tile.meshSize[0] ? tile.meshSize[0] : engine.local.tileSize[0]) / 3;
         }
+
+    if(meshed)
+        log.debug("Meshed %u tiles within %.2lfm at the finest level, %.1lfx fewer triangles than the grid, %u of %u levels meshed, in %.4lfs",
+            meshed, engine.options.meshError, (double) engine.local.tileSize[0] / 3 * meshed / triangles, ranges, meshed * DETAIL_LEVELS, glfwGetTime() - meshing);
+    for(uint32_t p = 0; p < count; ++ p)
+        loadTile(pending[p]);
+
+    return !cancelled;
+}
+
+// Called between row bands, only looks at the view when it has changed
+inline
+bool Loader::isStale(void)
+{
+    if(cancelled)
+        return true;
+
+    const uint64_t version = engine.local.viewVersion;
+    if(checked.exchange(version) == version)
+        return false;
+
+    uint32_t tileSize = 0;
+    const objects::Tile::ID _id = getFirstTile(engine.getBoundingRect(), tileSize);
+    if(_id.d != window.d || tileSize != windowSize)
+        cancelled = true;
+
+    return cancelled;
+}
+
+// Moves an uploaded swap layer into the cache, a spare takes its place
+inline
+void Loader::cacheTile(uint8_t t)
+{
+    putCached(staging[t].size, staging[t].id.d, swap[t], staging[t].heights, staging[t].errors);
+    swap[t] = spareLayer();
+}
+
+// Latitude only depends on the row and longitude on the column, so they are
+// projected once per tile, for sampling and for the 3D vertex shader to look up
+inline
+void Loader::projectTile(uint8_t t)
+{
+    Staging &tile = staging[t];
+    tile.rows.resize(TILE_DENSITY);
+    tile.columns.resize(TILE_DENSITY);
+    tile.trig.resize(TILE_DENSITY);
+    for(uint32_t i = 0; i < TILE_DENSITY; ++ i)
+    {
+        tile.rows[i]    = tile.box.z + (tile.box.w - tile.box.z) * i / (TILE_DENSITY - 1);
+        tile.columns[i] = tile.box.x + (tile.box.y - tile.box.x) * i / (TILE_DENSITY - 1);
+    }
+
+    mercator::metToLat(tile.rows.data(), tile.rows.data(), TILE_DENSITY);
+    mercator::metToLon(tile.columns.data(), tile.columns.data(), TILE_DENSITY);
+    for(uint32_t i = 0; i < TILE_DENSITY; ++ i)
+    {
+        const double lat = tile.rows[i] * M_PI / 180.0;
+        const double lon = tile.columns[i] * M_PI / 180.0;
+        tile.trig[i] = glm::vec4(cos(lat), sin(lat), cos(lon), sin(lon));
+    }
+}
+
+inline
+void Loader::swapTiles(const uint8_t *cached, uint32_t hits, const uint8_t *pending, uint32_t count)
+{
+    // Generated tiles were projected when prepared
+    for(uint32_t c = 0; c < hits; ++ c)
+        projectTile(cached[c]);
+
+    // Without fences the uploads have to be complete before the drawer sees them
+    if(!sync)
+        glFinish();
+
+    lock_guard<mutex> _lock(engine.local.tileLock);
+
+    // Swapped out layers are written again only after the drawer is done with them
+    if(sync && engine.gl.drawn)
+        glWaitSync(engine.gl.drawn, 0, GL_TIMEOUT_IGNORED);
+
+    for(uint32_t c = 0; c < hits; ++ c)
+        swapTile(engine.local.tile[cached[c]], cached[c]);
+
+    for(uint32_t p = 0; p < count; ++ p)
+        swapTile(engine.local.tile[pending[p]], pending[p]);
+
+    // Fences have to reach the server before the drawer waits for them
+    glFlush();
 }
 
 inline
 void Loader::markInvalidTiles(const objects::Tile::ID &_id, uint32_t tileSize)
 {
+    lock_guard<mutex> _lock(engine.local.tileLock);
     bool used[9]    = {};
     bool ordered[9] = {};
     for(int h = 0; h < 3; ++ h)
@@ -155,10 +434,10 @@ void Loader::markInvalidTiles(const objects::Tile::ID &_id, uint32_t tileSize)
 }
 
 inline
-objects::Tile::ID Loader::getFirstTile(uint32_t &tileSize)
+objects::Tile::ID Loader::getFirstTile(const glm::dvec4 &view, uint32_t &tileSize)
 {
-    glm::dvec4 view = engine.getBoundingRect();
-    tileSize = *lower_bound(divs, divs + TWO_POWER * FIVE_POWER, (int) (sqrt((view.y - view.x) * (view.y - view.x) + (view.w - view.z) * (view.w - view.z)) * 3 / 5));
+    // Predicted views may be larger than the whole map
+    tileSize = *lower_bound(divs, divs + TWO_POWER * FIVE_POWER, (int) min(MERCATOR_BOUNDS * 2.0, sqrt((view.y - view.x) * (view.y - view.x) + (view.w - view.z) * (view.w - view.z)) * 3 / 5));
     objects::Tile::ID _id;
     _id.w = max(0.0, min(MERCATOR_BOUNDS * 2.0 - 3 * tileSize, MERCATOR_BOUNDS + view.x)) / tileSize;
     _id.h = max(0.0, min(MERCATOR_BOUNDS * 2.0 - 3 * tileSize, MERCATOR_BOUNDS + view.z)) / tileSize;
@@ -166,83 +445,674 @@ objects::Tile::ID Loader::getFirstTile(uint32_t &tileSize)
     return _id;
 }
 
+// Bounding rect velocity (edges per second) covers panning and zooming in both
+// views. The loader only runs while busy or woken by a view change, so older
+// velocity is weighted down by the loader frames since: a view left still
+// decays it to zero instead of prefetching along a stale one.
+inline
+void Loader::updateMotion(const glm::dvec4 &view)
+{
+    const double now = glfwGetTime();
+    if(prefetch.time > 0.0 && now > prefetch.time)
+    {
+        const double keep = exp(-(now - prefetch.time) * LOADER_FPS);
+        prefetch.velocity = prefetch.velocity * keep + (view - prefetch.view) / (now - prefetch.time) * (1.0 - keep);
+    }
+
+    prefetch.view = view;
+    prefetch.time = now;
+}
+
+// Generates the tiles of the predicted view straight into the tile cache
 inline
-bool Loader::loadTile(uint8_t t, const objects::Tile::ID &_id, uint32_t tileSize)
+bool Loader::prefetchTiles(const objects::Tile::ID &_id, uint32_t tileSize)
 {
-    const uint32_t density  = (1 << DETAIL_LEVELS) + 1;
-    const uint32_t size     = density * density;
-    glBindBuffer(GL_ARRAY_BUFFER, engine.gl.buffer[engine::SWAP_BUFFER_1 + t]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(objects::TerrainPoint) * size, nullptr, GL_DYNAMIC_DRAW);
-    objects::TerrainPoint *buffer = (objects::TerrainPoint *) glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-    objects::Tile::ID   ID;
-    glm::vec4           box;
+    const glm::dvec4 predicted = prefetch.view + prefetch.velocity * PREFETCH_AHEAD;
+    uint32_t size = 0;
+    objects::Tile::ID first = getFirstTile(predicted, size);
+    if(size == tileSize && first.d == _id.d)
+        return false;
 
-    ID.d    = _id.d;
-    box.x   = -MERCATOR_BOUNDS + _id.w * tileSize;
-    box.y   = box.x + tileSize;
-    box.z   = -MERCATOR_BOUNDS + _id.h * tileSize;
-    box.w   = box.z + tileSize;
-    log.debug("Tile (%u %u) box: [%.2f, %.2f, %.2f, %.2f] size: %d", ID.w, ID.h, box.x, box.y, box.z, box.w, tileSize);
+    // Closest to the predicted view centre first
+    const glm::dvec2 center((predicted.x + predicted.y) / 2.0, (predicted.z + predicted.w) / 2.0);
+    pair<double, objects::Tile::ID> candidates[9];
+    for(uint8_t o = 0; o < 9; ++ o)
+    {
+        candidates[o].second.h  = first.h + o / 3;
+        candidates[o].second.w  = first.w + o % 3;
+        candidates[o].first     = glm::distance(center, glm::dvec2(
+            -MERCATOR_BOUNDS + (candidates[o].second.w + 0.5) * size,
+            -MERCATOR_BOUNDS + (candidates[o].second.h + 0.5) * size));
+    }
 
-    int16_t lon = -32768;
-    int16_t lat = -32768;
+    sort(candidates, candidates + 9, [](const pair<double, objects::Tile::ID> &a, const pair<double, objects::Tile::ID> &b) {return a.first < b.first;});
 
-    unordered_map<int16_t, hgt::Map>    *row    = nullptr;
-    hgt::Map                            *chunk  = nullptr;
-    for(uint16_t h = 0; h < density; ++ h)
+    uint8_t     pending[9];
+    uint32_t    count = 0;
+    for(uint8_t o = 0; o < 9 && count < PREFETCH_TILES; ++ o)
     {
-        const double    y       = box.z + (box.w - box.z) * h / (density - 1);
-        const double    _lat    = mercator::metToLat(y);
+        const objects::Tile::ID &__id = candidates[o].second;
+        if(size == tileSize && __id.h - _id.h < 3 && __id.w - _id.w < 3)
+            continue;
+
+        if(cache.tiles.count(CacheKey(size, __id.d)))
+            continue;
+
+        // Own slots, the view's staging tiles and swap layers stay untouched
+        const uint8_t t = PREFETCH_SLOT + count;
+        placeTile(t, __id, size);
+        if(isEmpty(t))
+            continue;
+
+        prepareTile(t, 0);
+        pending[count ++] = t;
+    }
+
+    if(!count)
+        return false;
+
+    // Moving the window cancels prefetching, finished tiles are kept anyway
+    generateTiles(pending, count);
+    for(uint32_t p = 0; p < count; ++ p)
+    {
+        cacheTile(pending[p]);
+        prefetch.tiles.insert(CacheKey(staging[pending[p]].size, staging[pending[p]].id.d));
+        ++ prefetch.issued;
+    }
+
+    glFlush();
+    return true;
+}
+
+inline
+void Loader::placeTile(uint8_t t, const objects::Tile::ID &_id, uint32_t tileSize)
+{
+    Staging &tile = staging[t];
+    tile.id.d   = _id.d;
+    tile.box.x  = -MERCATOR_BOUNDS + _id.w * tileSize;
+    tile.box.y  = tile.box.x + tileSize;
+    tile.box.z  = -MERCATOR_BOUNDS + _id.h * tileSize;
+    tile.box.w  = tile.box.z + tileSize;
+    tile.size   = tileSize;
+    tile.detail = 0;
+    tile.cached = false;
+}
+
+// Tiles outside all the maps, or with none in any square they sample
+inline
+bool Loader::isEmpty(uint8_t t)
+{
+    const Staging &tile = staging[t];
+    const auto &bound = engine.local.bound;
+    if(tile.box.x > bound.max.x || tile.box.y < bound.min.x || tile.box.z > bound.max.y || tile.box.w < bound.min.y)
+        return true;
+
+    const int16_t minLat = floor(mercator::metToLat(tile.box.z));
+    const int16_t maxLat = floor(mercator::metToLat(tile.box.w));
+    const int16_t minLon = floor(mercator::metToLon(tile.box.x));
+    const int16_t maxLon = floor(mercator::metToLon(tile.box.y));
+    for(int16_t lat = minLat; lat <= maxLat; ++ lat)
+        for(int16_t lon = minLon; lon <= maxLon; ++ lon)
+            if(engine.local.world.has(lat, lon))
+                return false;
+
+    return true;
+}
+
+inline
+void Loader::prepareTile(uint8_t t, uint8_t detail)
+{
+    Staging &tile = staging[t];
+    const uint32_t tileSize = tile.size;
+    tile.detail = detail;
+    tile.step   = 1 << detail;
+    tile.lon.resize(TILE_DENSITY);
+    tile.cx.resize(TILE_DENSITY);
+
+    // Coarsest map level that is still at least as dense as the tile
+    tile.level = 0;
+    while(tile.level < hgt::LEVELS - 1 && mercator::lonToMet((2 << tile.level) / 1200.0) <= tileSize * tile.step / (TILE_DENSITY - 1.0))
+        ++ tile.level;
+
+    // Columns are the same for every row
+    projectTile(t);
+    const int32_t last = hgt::levelSamples(tile.level) - 1;
+    for(uint16_t w = 0; w < TILE_DENSITY; ++ w)
+    {
+        const double    _lon    = tile.columns[w];
+        tile.lon[w] = floor(_lon);
+        tile.cx[w]  = floor((_lon - tile.lon[w]) * last);
+        assert(0 <= tile.cx[w] && tile.cx[w] <= last);
+    }
+
+    // Staging ring slot, waiting until its previous copy is done
+    tile.meshed = !detail && engine.options.meshError > 0.0;
+    if(persistent)
+    {
+        tile.slot   = ring.next;
+        ring.next   = (ring.next + 1) % STAGING_SLOTS;
+        waitFence(ring.fence[tile.slot]);
+    }
+
+    // Generated straight into the slot, tiles are also read back to be measured
+    // and meshed, which write combined ring memory is too slow for, so the
+    // samples go to a client copy as well. Without the ring it is the only one.
+    tile.copy.resize(TILE_DENSITY * TILE_DENSITY);
+    tile.points = persistent ? (objects::TerrainPoint *) (ring.data + tile.slot * TILE_BYTES) : tile.copy.data();
+
+    // Coarse tiles only fill every step-th sample of the layer, the ones in
+    // between go up as voids instead of whatever the last tile left there
+    if(detail)
+        fill(tile.points, tile.points + TILE_DENSITY * TILE_DENSITY, objects::TerrainPoint(32768));
+
+    log.debug("Tile (%u %u) box: [%.2f, %.2f, %.2f, %.2f] size: %d level: %u detail: %u", tile.id.w, tile.id.h, tile.box.x, tile.box.y, tile.box.z, tile.box.w, tileSize, tile.level, tile.detail);
+}
+
+inline
+void Loader::generateTile(uint8_t t, uint32_t band)
+{
+    Staging         &tile   = staging[t];
+    const int32_t   last    = hgt::levelSamples(tile.level) - 1;
+    const uint32_t  rows    = (TILE_DENSITY + TILE_BANDS - 1) / TILE_BANDS;
+    int16_t         lon     = -32768;
+    int16_t         lat     = -32768;
+    uint16_t        low     = 65535;
+    uint16_t        high    = 0;
+    uint32_t        voids   = 0;
+
+    unordered_map<int16_t, shared_ptr<hgt::Map> >   row;
+    hgt::Map                                        *chunk  = nullptr;
+    for(uint32_t h = band * rows; h < min(TILE_DENSITY, (band + 1) * rows); ++ h)
+    {
+        if(h % tile.step)
+            continue;
+
+        const double    _lat    = tile.rows[h];
         const int16_t   __lat   = floor(_lat);
-        const int16_t   cy      = floor((_lat - __lat) * 1200);
+        const int16_t   cy      = floor((_lat - __lat) * last);
 
-        assert(0 <= cy && cy <= 1200);
+        assert(0 <= cy && cy <= last);
         if(__lat != lat)
         {
             lat     = __lat;
-            row     = engine.local.world.count(lat) ? &engine.local.world[lat] : nullptr;
             chunk   = nullptr;
+            row.clear();
             lon     = -32768;
         }
 
-        for(uint16_t w = 0; w < density; ++ w)
+        objects::TerrainPoint *points   = tile.points + h * TILE_DENSITY;
+        objects::TerrainPoint *samples  = tile.copy.data() + h * TILE_DENSITY;
+        for(uint32_t w = 0; w < TILE_DENSITY; w += tile.step)
         {
-            const double    x       = box.x + (box.y - box.x) * w / (density - 1);
-            const double    _lon    = mercator::metToLon(x);
-            const int16_t   __lon   = floor(_lon);
-            const int16_t   cx      = floor((_lon - __lon) * 1200);
-            const uint32_t  b       = h * density + w;
-
-            assert(0 <= cx && cx <= 1200);
-            if(__lon != lon)
+            if(tile.lon[w] != lon)
+            {
+                lon     = tile.lon[w];
+                auto cached = row.find(lon);
+                if(cached == row.end())
+                    cached = row.emplace(lon, engine.local.world.get(lat, lon)).first;
+
+                chunk   = cached->second.get();
+            }
+
+            // Heights as drawn, missing maps at the bias level
+            const uint16_t height = chunk ? chunk->get(tile.cx[w], cy, tile.level) : 32768;
+            points[w].height   = height;
+            samples[w].height  = height;
+            low     = min<uint16_t>(low, height == 32768 ? 0 : height);
+            high    = max<uint16_t>(high, height == 32768 ? 0 : height);
+            voids   += height == 32768;
+        }
+    }
+
+    tile.bands[band] = glm::vec2(low, high);
+    tile.voids[band] = voids;
+}
+
+// Largest height deviation (voids at 0) of every grid level from the samples,
+// at the edge middles and cell centres it skips against the triangles drawn
+// instead, which split cells along the rising diagonal. Finer levels' errors
+// carry over, levels the tile has no finer samples for are exact.
+inline
+void Loader::measureTile(uint8_t t)
+{
+    Staging &tile = staging[t];
+    const auto height = [&tile](uint32_t x, uint32_t y)
+    {
+        const uint16_t sample = tile.copy[y * TILE_DENSITY + x].height;
+        return sample == 32768 ? 0.0f : (float) sample;
+    };
+
+    fill(tile.errors, tile.errors + DETAIL_LEVELS, 0.0f);
+    for(uint32_t l = tile.detail + 1; l < DETAIL_LEVELS; ++ l)
+    {
+        const uint32_t step = 1 << l;
+        const uint32_t half = step / 2;
+        float error = tile.errors[l - 1];
+        for(uint32_t y = 0; y < TILE_DENSITY; y += half)
+            for(uint32_t x = (y % step ? 0 : half); x < TILE_DENSITY; x += (y % step ? half : step))
             {
-                lon     = __lon;
-                chunk   = row && row->count(lon) ? &(*row)[lon] : nullptr;
+                float expected;
+                if(y % step == 0)
+                    expected = (height(x - half, y) + height(x + half, y)) / 2.0f;
+
+                else if(x % step == 0)
+                    expected = (height(x, y - half) + height(x, y + half)) / 2.0f;
+
+                else
+                    expected = (height(x + half, y - half) + height(x - half, y + half)) / 2.0f;
+
+                error = max(error, abs(height(x, y) - expected));
             }
 
-            assert(lon != -32768 && lat != -32768);
+        tile.errors[l] = error;
+    }
+}
+
+// Right-triangulated irregular network of a full density tile, coarse ones
+// are drawn with the grid until refined. Every level gets a range extracted
+// within the error of its grid, kept only when it is fewer triangles, so the
+// level picked for the tile bounds both its error and its cost.
+inline
+void Loader::meshTile(uint8_t t)
+{
+    Staging &tile = staging[t];
+    tile.mesh.clear();
+    fill(tile.meshSize, tile.meshSize + DETAIL_LEVELS, 0);
+    if(!tile.meshed)
+        return;
+
+    tile.rtin.update((const uint16_t *) tile.copy.data(), TILE_DENSITY);
+    float       current = -1.0f;
+    bool        kept    = false;
+    uint32_t    first   = 0;
+    for(uint32_t l = 0; l < DETAIL_LEVELS; ++ l)
+    {
+        // Levels within the same error share their range
+        const float error = max<float>(engine.options.meshError, tile.errors[l]);
+        if(error != current)
+        {
+            tile.rtin.extract(error, tile.extracted);
+            current = error;
+            kept    = false;
+        }
+
+        if(tile.extracted.size() >= engine.local.tileSize[l])
+            continue;
 
-            assert(b < size);
-            buffer[b].height = chunk ? chunk->get(cx, cy) : 32768;
+        if(!kept)
+        {
+            first   = tile.mesh.size();
+            kept    = true;
+            tile.mesh.insert(tile.mesh.end(), tile.extracted.begin(), tile.extracted.end());
         }
+
+        tile.meshFirst[l]   = first;
+        tile.meshSize[l]    = tile.extracted.size();
+    }
+}
+
+inline
+bool Loader::loadTile(uint8_t t)
+{
+    // Straight from the staging ring, which doubles as the pixel unpack buffer
+    const GLvoid *pixels = staging[t].points;
+    if(persistent)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.buffer);
+        pixels = (const GLvoid *) (staging[t].slot * TILE_BYTES);
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, engine.gl.heights);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, swap[t], TILE_DENSITY, TILE_DENSITY, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, pixels);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    // The layer's meshes go with it into the view or the cache
+    copy(staging[t].meshFirst, staging[t].meshFirst + DETAIL_LEVELS, engine.local.meshFirst.begin() + swap[t] * DETAIL_LEVELS);
+    copy(staging[t].meshSize, staging[t].meshSize + DETAIL_LEVELS, engine.local.meshSize.begin() + swap[t] * DETAIL_LEVELS);
+    if(!staging[t].mesh.empty())
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, engine.gl.meshIndice[swap[t]]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, staging[t].mesh.size() * sizeof(uint32_t), staging[t].mesh.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+
+    if(persistent)
+    {
+        ring.fence[staging[t].slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
     }
 
-    glUnmapBuffer(GL_ARRAY_BUFFER);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
     return true;
 }
 
 inline
-bool Loader::swapTile(objects::Tile &tile, const objects::Tile::ID &_id, uint32_t tileSize, uint8_t t)
+bool Loader::swapTile(objects::Tile &tile, uint8_t t)
 {
-    swap(engine.gl.buffer[engine::SWAP_BUFFER_1 + t], tile.buffer);
-    tile.id.d   = _id.d;
-    tile.box.x  = -MERCATOR_BOUNDS + _id.w * tileSize;
-    tile.box.y  = tile.box.x + tileSize;
-    tile.box.z  = -MERCATOR_BOUNDS + _id.h * tileSize;
-    tile.box.w  = tile.box.z + tileSize;
+    // Swapped out full tile is kept for later, the swap layer gets refilled,
+    // the empty layer stays shared
+    const bool shared = tile.layer == ::engine::EMPTY_LAYER;
+    if(!shared && tile.size && !tile.detail)
+        putCached(tile.size, tile.id.d, tile.layer, tile.heights, tile.errors);
 
-    tile.size   = tileSize;
+    else if(!shared)
+        cache.spare.push_back(tile.layer);
+
+    if(staging[t].cached)
+        tile.layer = staging[t].layer;
+
+    else
+    {
+        tile.layer  = swap[t];
+        swap[t]     = spareLayer();
+    }
+
+    // Drawer is done with the previous box, see glWaitSync in swapTiles
+    if(tile.box != staging[t].box)
+    {
+        glBindTexture(GL_TEXTURE_2D, engine.gl.trig);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, t, TILE_DENSITY, 1, GL_RGBA, GL_FLOAT, staging[t].trig.data());
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    tile.id.d   = staging[t].id.d;
+    tile.box    = staging[t].box;
+    tile.size   = staging[t].size;
+    tile.detail = staging[t].detail;
+    tile.heights = staging[t].heights;
+    copy(staging[t].errors, staging[t].errors + DETAIL_LEVELS, tile.errors);
     tile.valid  = true;
+
+    // Drawer waits (on the GPU) for the upload before the first draw
+    if(tile.fence)
+        glDeleteSync(tile.fence);
+
+    tile.fence  = sync ? glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) : nullptr;
     return true;
 }
+
+inline
+void Loader::setupRing(void)
+{
+    const GLsizeiptr size   = STAGING_SLOTS * TILE_BYTES;
+    const GLbitfield flags  = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &ring.buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.buffer);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+    ring.data = (uint8_t *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if(!ring.data)
+    {
+        log.warning("Couldn't map staging ring, falling back to client memory uploads");
+        glDeleteBuffers(1, &ring.buffer);
+        ring.buffer = 0;
+        persistent  = false;
+    }
+}
+
+inline
+void Loader::releaseRing(void)
+{
+    for(uint32_t s = 0; s < STAGING_SLOTS; ++ s)
+        waitFence(ring.fence[s]);
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.buffer);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &ring.buffer);
+    ring.buffer = 0;
+    ring.data   = nullptr;
+}
+
+inline
+void Loader::waitFence(GLsync &fence)
+{
+    if(!fence)
+        return;
+
+    while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+inline
+bool Loader::takeCached(uint32_t tileSize, uint64_t tileId, uint32_t &layer, glm::vec2 &heights, float *errors)
+{
+    auto cached = cache.tiles.find(CacheKey(tileSize, tileId));
+    if(cached == cache.tiles.end())
+    {
+        ++ cache.misses;
+        return false;
+    }
+
+    layer   = cached->second.layer;
+    heights = cached->second.heights;
+    copy(cached->second.errors, cached->second.errors + DETAIL_LEVELS, errors);
+    if(prefetch.tiles.erase(cached->first))
+        ++ prefetch.used;
+
+    cache.used.erase(cached->second.used);
+    cache.tiles.erase(cached);
+    ++ cache.hits;
+    return true;
+}
+
+inline
+void Loader::putCached(uint32_t tileSize, uint64_t tileId, uint32_t layer, const glm::vec2 &heights, const float *errors)
+{
+    const CacheKey key(tileSize, tileId);
+    assert(!cache.tiles.count(key));
+    cache.used.push_front(key);
+    Cached &cached  = cache.tiles[key];
+    cached.layer    = layer;
+    cached.heights  = heights;
+    cached.used     = cache.used.begin();
+    copy(errors, errors + DETAIL_LEVELS, cached.errors);
+
+    // Evicted layers are reused for uploads
+    while(cache.tiles.size() > cache.limit)
+    {
+        auto evicted = cache.tiles.find(cache.used.back());
+        cache.spare.push_back(evicted->second.layer);
+        prefetch.tiles.erase(evicted->first);
+        cache.tiles.erase(evicted);
+        cache.used.pop_back();
+        ++ cache.evictions;
+    }
+}
+
+// Layers are all allocated up front, the cache limit keeps one spare
+inline
+uint32_t Loader::spareLayer(void)
+{
+    assert(!cache.spare.empty());
+    const uint32_t layer = cache.spare.back();
+    cache.spare.pop_back();
+    return layer;
+}
+
+// Levels follow the ground point under the eye, the finest one drawn is the
+// first to reach a few altitudes away, so the triangle count does not depend
+// on the height. Origins snap to every other sample of the level, which keeps
+// each level at most one cell off the centre of the coarser one.
+inline
+bool Loader::updateClipmap(void)
+{
+    const glm::dvec3    eye         = engine.local.d3d.eye;
+    const double        distance    = glm::length(eye);
+    const double        altitude    = max(0.0, distance - mercator::EQUATORIAL_RADIUS);
+    const double        bound       = mercator::metToLat(MERCATOR_BOUNDS);
+    const double        lat         = max(-bound, min(bound, asin(eye.z / distance) * 180.0 / M_PI));
+    const double        x           = mercator::lonToMet(atan2(eye.y, eye.x) * 180.0 / M_PI);
+    const double        y           = mercator::latToMet(lat);
+
+    uint8_t first = 0;
+    while(first < CLIPMAP_LEVELS - CLIPMAP_ACTIVE && CLIPMAP_SPACING * (1 << first) * (CLIPMAP_SIZE / 2) < CLIPMAP_REACH * altitude)
+        ++ first;
+
+    uint32_t    pending[CLIPMAP_ACTIVE];
+    uint32_t    count   = 0;
+    for(uint32_t l = first; l < first + (uint32_t) CLIPMAP_ACTIVE; ++ l)
+    {
+        Level           &level  = clipmap.level[l];
+        const double    spacing = CLIPMAP_SPACING * (1 << l);
+        level.target = glm::ivec2(round(x / spacing / 2.0), round(y / spacing / 2.0)) * 2 - (CLIPMAP_SIZE - 1) / 2;
+        if(!level.valid || level.target != level.origin)
+            pending[count ++] = l;
+    }
+
+    if(!count && first == clipmap.first && engine.local.clipmap.ready)
+        return false;
+
+    const double start = glfwGetTime();
+    uint32_t refilled = 0;
+    for(uint32_t p = 0; p < count; ++ p)
+        refilled += !clipmap.level[pending[p]].valid;
+
+    pool.run(count, [&](uint32_t job)
+    {
+        sampleLevel(pending[job]);
+    });
+
+    {
+        lock_guard<mutex> _lock(engine.local.tileLock);
+
+        // Uncovered texels may still be drawn at their previous place
+        if(sync && engine.gl.drawn)
+            glWaitSync(engine.gl.drawn, 0, GL_TIMEOUT_IGNORED);
+
+        for(uint32_t p = 0; p < count; ++ p)
+            uploadLevel(pending[p]);
+
+        if(!sync)
+            glFinish();
+
+        engine::Engine::Local::Clipmap &published = engine.local.clipmap;
+        for(uint32_t l = first; l < first + (uint32_t) CLIPMAP_ACTIVE; ++ l)
+            published.origin[l] = clipmap.level[l].origin;
+
+        published.first = first;
+        published.ready = true;
+        if(published.fence)
+            glDeleteSync(published.fence);
+
+        published.fence = sync ? glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) : nullptr;
+        glFlush();
+    }
+
+    if(refilled || first != clipmap.first)
+        log.debug("Clipmap levels %u-%u around (%.2lf, %.2lf), %u refilled in %.4lfs",
+            first, first + CLIPMAP_ACTIVE - 1, x, y, refilled, glfwGetTime() - start);
+
+    clipmap.first = first;
+    return true;
+}
+
+// Runs on the pool: projects the level's rows and columns and samples the
+// ones it uncovers, the whole level when it moved too far or was not filled
+inline
+void Loader::sampleLevel(uint32_t l)
+{
+    Level               &level  = clipmap.level[l];
+    const int32_t       size    = CLIPMAP_SIZE;
+    const double        spacing = CLIPMAP_SPACING * (1 << l);
+    const glm::ivec2    shift   = level.target - level.origin;
+    const bool          whole   = !level.valid || abs(shift.x) >= size || abs(shift.y) >= size;
+
+    // Coarsest map level that is still at least as dense as the clipmap level
+    level.level = 0;
+    while(level.level < hgt::LEVELS - 1 && mercator::lonToMet((2 << level.level) / 1200.0) <= spacing)
+        ++ level.level;
+
+    // Coarse levels wider than the map collapse onto its edges and onto the
+    // antimeridian opposite the eye
+    const double    half    = mercator::lonToMet(180.0);
+    const double    centre  = (level.target.x + size / 2) * spacing;
+    level.lat.resize(size);
+    level.lon.resize(size);
+    level.trig.resize(size);
+    for(int32_t i = 0; i < size; ++ i)
+    {
+        level.lat[i] = max(-MERCATOR_BOUNDS, min(MERCATOR_BOUNDS, (level.target.y + i) * spacing));
+        level.lon[i] = max(centre - half, min(centre + half, (level.target.x + i) * spacing));
+    }
+
+    mercator::metToLat(level.lat.data(), level.lat.data(), size);
+    mercator::metToLon(level.lon.data(), level.lon.data(), size);
+    for(int32_t i = 0; i < size; ++ i)
+    {
+        const double lat = level.lat[i] * M_PI / 180.0;
+        const double lon = level.lon[i] * M_PI / 180.0;
+        level.trig[i] = glm::vec4(cos(lat), sin(lat), cos(lon), sin(lon));
+    }
+
+    level.columns.clear();
+    level.rows.clear();
+    for(int32_t i = 0; i < size; ++ i)
+    {
+        const int32_t w = level.target.x + i;
+        const int32_t h = level.target.y + i;
+        if(whole || (uint32_t) (w - level.origin.x) >= CLIPMAP_SIZE)
+            level.columns.push_back(w);
+
+        if(!whole && (uint32_t) (h - level.origin.y) >= CLIPMAP_SIZE)
+            level.rows.push_back(h);
+    }
+
+    // Heights as drawn, missing maps at the bias level
+    const int32_t last = hgt::levelSamples(level.level) - 1;
+    unordered_map<int32_t, shared_ptr<hgt::Map> > maps;
+    const auto sample = [&](int32_t w, int32_t h) -> uint16_t
+    {
+        const double    _lat    = level.lat[h];
+        const double    _lon    = level.lon[w] - 360.0 * floor((level.lon[w] + 180.0) / 360.0);
+        const int16_t   lat     = floor(_lat);
+        const int16_t   lon     = floor(_lon);
+        const int32_t   key     = (int32_t) lat << 16 | (uint16_t) lon;
+        auto cached = maps.find(key);
+        if(cached == maps.end())
+            cached = maps.emplace(key, engine.local.world.get(lat, lon)).first;
+
+        if(!cached->second)
+            return 32768;
+
+        return cached->second->get(floor((_lon - lon) * last), floor((_lat - lat) * last), level.level);
+    };
+
+    // Texel order, a column from the first texel row and a row from the first texel column
+    level.samples.resize((level.columns.size() + level.rows.size()) * size);
+    uint16_t *samples = level.samples.data();
+    for(const int32_t w: level.columns)
+        for(int32_t t = 0; t < size; ++ t)
+            *samples ++ = sample(w - level.target.x, clipmapTexel(t - level.target.y));
+
+    for(const int32_t h: level.rows)
+        for(int32_t t = 0; t < size; ++ t)
+            *samples ++ = sample(clipmapTexel(t - level.target.x), h - level.target.y);
+}
+
+inline
+void Loader::uploadLevel(uint32_t l)
+{
+    Level           &level      = clipmap.level[l];
+    const uint16_t  *samples    = level.samples.data();
+    glBindTexture(GL_TEXTURE_2D_ARRAY, engine.gl.clipmapHeights);
+    for(const int32_t w: level.columns)
+    {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, clipmapTexel(w), 0, l, 1, CLIPMAP_SIZE, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, samples);
+        samples += CLIPMAP_SIZE;
+    }
+
+    for(const int32_t h: level.rows)
+    {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, clipmapTexel(h), l, CLIPMAP_SIZE, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, samples);
+        samples += CLIPMAP_SIZE;
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glBindTexture(GL_TEXTURE_2D, engine.gl.clipmapTrig);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, l, CLIPMAP_SIZE, 1, GL_RGBA, GL_FLOAT, level.trig.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    level.origin    = level.target;
+    level.valid     = true;
+}
@@ -1,11 +1,20 @@
 #ifndef __LOADER_H__
 #define __LOADER_H__
 
+#include <vector>
+#include <list>
+#include <map>
+#include <set>
+#include <utility>
+#include <atomic>
+
 #include "libs/logger/logger.h"
 #include "libs/thread/thread.h"
+#include "libs/thread/pool.h"
 
 #include "engine/engine.h"
 #include "engine/objects.h"
+#include "mesh/rtin.h"
 
 namespace terrain
 {
@@ -13,11 +22,130 @@ namespace terrain
 namespace loader
 {
 
+// Tiles in flight in the staging ring, two full views
+static const uint32_t STAGING_SLOTS = 18;
+
+// Staging tiles, the view's then the prefetched ones
+static const uint32_t PREFETCH_SLOT = 9;
+static const uint32_t STAGING_TILES = PREFETCH_SLOT + PREFETCH_TILES;
+
+// Row bands a tile is generated in, also the cancellation granularity
+static const uint32_t TILE_BANDS    = 16;
+
 class Loader: public Thread
 {
     Logger          log;
     engine::Engine  &engine;
     uint32_t        divs[128];
+    ThreadPool      pool;
+
+    bool            persistent;
+    bool            sync;
+
+    // Window the tiles being generated belong to, work stops once it moves
+    objects::Tile::ID       window;
+    uint32_t                windowSize;
+    std::atomic<uint64_t>   checked;
+    std::atomic<bool>       cancelled;
+
+    // CPU side copy of a tile, filled by the pool and uploaded afterwards
+    struct Staging
+    {
+        objects::Tile::ID                   id;
+        glm::vec4                           box;
+        uint32_t                            size;
+        uint32_t                            level;
+        uint32_t                            step;
+        uint8_t                             detail;
+        uint32_t                            slot;
+        bool                                cached;
+        uint32_t                            layer;
+        std::atomic<uint32_t>               done;
+        glm::vec2                           bands[TILE_BANDS];
+        uint32_t                            voids[TILE_BANDS];
+        glm::vec2                           heights;
+        float                               errors[DETAIL_LEVELS];
+        std::vector<double>                 rows;
+        std::vector<double>                 columns;
+        std::vector<int16_t>                lon;
+        std::vector<int16_t>                cx;
+        std::vector<glm::vec4>              trig;
+        objects::TerrainPoint               *points;
+        std::vector<objects::TerrainPoint>  copy;
+        bool                                meshed;
+        mesh::Rtin                          rtin;
+        std::vector<uint32_t>               mesh;
+        std::vector<uint32_t>               extracted;
+        uint32_t                            meshFirst[DETAIL_LEVELS];
+        uint32_t                            meshSize[DETAIL_LEVELS];
+    } staging[STAGING_TILES];
+
+    // Persistently mapped staging buffer, slots are reused once copied out
+    struct Ring
+    {
+        GLuint                              buffer;
+        uint8_t                             *data;
+        GLsync                              fence[STAGING_SLOTS];
+        uint32_t                            next;
+    } ring;
+
+    // Height layers the tiles are uploaded to before being swapped in or cached
+    uint32_t        swap[STAGING_TILES];
+
+    // Generated tiles swapped out of the view, by (tile size, tile id)
+    typedef std::pair<uint32_t, uint64_t> CacheKey;
+    struct Cached
+    {
+        uint32_t                            layer;
+        glm::vec2                           heights;
+        float                               errors[DETAIL_LEVELS];
+        std::list<CacheKey>::iterator       used;
+    }; // struct Cached
+
+    struct Cache
+    {
+        std::map<CacheKey, Cached>          tiles;
+        std::list<CacheKey>                 used;
+        std::vector<uint32_t>               spare;
+        uint32_t                            limit;
+        uint64_t                            hits;
+        uint64_t                            misses;
+        uint64_t                            evictions;
+    } cache;
+
+    // View motion and tiles generated ahead of it
+    struct Prefetch
+    {
+        glm::dvec4                          view;
+        glm::dvec4                          velocity;
+        double                              time;
+        std::set<CacheKey>                  tiles;
+        uint64_t                            issued;
+        uint64_t                            used;
+    } prefetch;
+
+    // Clipmap level as uploaded, its texels addressed by world grid index
+    // modulo CLIPMAP_SIZE so moving it only rewrites the rows and columns it
+    // uncovers. The new rows and columns are sampled into a single buffer.
+    struct Level
+    {
+        bool                                valid;
+        glm::ivec2                          origin;
+        glm::ivec2                          target;
+        uint32_t                            level;
+        std::vector<double>                 lat;
+        std::vector<double>                 lon;
+        std::vector<glm::vec4>              trig;
+        std::vector<int32_t>                columns;
+        std::vector<int32_t>                rows;
+        std::vector<uint16_t>               samples;
+    }; // struct Level
+
+    struct Clipmap
+    {
+        Level                               level[CLIPMAP_LEVELS];
+        uint8_t                             first;
+    } clipmap;
 
     public:
         Loader(Log &_log, engine::Engine &_engine);
@@ -31,11 +159,36 @@ class Loader: public Thread
         void terminate(void);
 
     private:
-        void checkTiles(void);
+        bool checkTiles(void);
         void markInvalidTiles(const objects::Tile::ID &_id, uint32_t tileSize);
-        objects::Tile::ID getFirstTile(uint32_t &tileSize);
-        bool loadTile(uint8_t t, const objects::Tile::ID &_id, uint32_t tileSize);
-        bool swapTile(objects::Tile &tile, const objects::Tile::ID &_id, uint32_t tileSize, uint8_t t);
+        objects::Tile::ID getFirstTile(const glm::dvec4 &view, uint32_t &tileSize);
+        void updateMotion(const glm::dvec4 &view);
+        bool prefetchTiles(const objects::Tile::ID &_id, uint32_t tileSize);
+        void placeTile(uint8_t t, const objects::Tile::ID &_id, uint32_t tileSize);
+        bool isEmpty(uint8_t t);
+        void prepareTile(uint8_t t, uint8_t detail);
+        void generateTile(uint8_t t, uint32_t band);
+        void measureTile(uint8_t t);
+        void meshTile(uint8_t t);
+        bool loadTile(uint8_t t);
+        bool generateTiles(uint8_t *pending, uint32_t &count);
+        bool isStale(void);
+        void cacheTile(uint8_t t);
+        void projectTile(uint8_t t);
+        void swapTiles(const uint8_t *cached, uint32_t hits, const uint8_t *pending, uint32_t count);
+        bool swapTile(objects::Tile &tile, uint8_t t);
+
+        void setupRing(void);
+        void releaseRing(void);
+        void waitFence(GLsync &fence);
+
+        bool takeCached(uint32_t tileSize, uint64_t tileId, uint32_t &layer, glm::vec2 &heights, float *errors);
+        void putCached(uint32_t tileSize, uint64_t tileId, uint32_t layer, const glm::vec2 &heights, const float *errors);
+        uint32_t spareLayer(void);
+
+        bool updateClipmap(void);
+        void sampleLevel(uint32_t l);
+        void uploadLevel(uint32_t l);
 }; // class Loader
 
 } // namespace loader
@@ -0,0 +1,138 @@
+#ifndef __MESH_RTIN_H__
+#define __MESH_RTIN_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <cassert>
+#include <cfloat>
+#include <vector>
+#include <algorithm>
+
+namespace terrain
+{
+
+namespace mesh
+{
+
+/*
+ * Right-triangulated irregular network (Martini) over a grid of 2^n + 1
+ * biased heights, void (32768) counting as 0 like in the shaders. Every
+ * triangle is split at the middle of its hypotenuse, the error kept there is
+ * the largest one of the whole subtree, so extracting stops at the first
+ * triangle within the threshold. Border vertices are always kept, which lets
+ * neighbouring tiles meet without cracks whatever their meshes.
+ */
+class Rtin
+{
+    uint32_t            size;
+    std::vector<float>  errors;
+
+    public:
+        Rtin(void);
+
+        void update(const uint16_t *heights, uint32_t _size);
+        void extract(float maxError, std::vector<uint32_t> &indices);
+
+    private:
+        float height(const uint16_t *heights, uint32_t x, uint32_t y) const;
+        void measure(const uint16_t *heights, uint32_t depth, bool leaf, uint32_t ax, uint32_t ay, uint32_t bx, uint32_t by, uint32_t cx, uint32_t cy);
+        void split(float maxError, std::vector<uint32_t> &indices, uint32_t ax, uint32_t ay, uint32_t bx, uint32_t by, uint32_t cx, uint32_t cy) const;
+}; // class Rtin
+
+inline
+Rtin::Rtin(void)
+:size(0)
+,errors()
+{
+}
+
+// A level of triangles at a time, smallest first, so both triangles sharing
+// a hypotenuse are measured before their parents look at its middle
+inline
+void Rtin::update(const uint16_t *heights, uint32_t _size)
+{
+    assert(_size > 2 && !((_size - 1) & (_size - 2)));
+    size = _size;
+
+    const uint32_t last = size - 1;
+    errors.assign(size * size, 0.0f);
+    for(uint32_t i = 0; i < size; ++ i)
+    {
+        errors[i]                   = FLT_MAX;
+        errors[last * size + i]     = FLT_MAX;
+        errors[i * size]            = FLT_MAX;
+        errors[i * size + last]     = FLT_MAX;
+    }
+
+    // Legs halve every other level, the smallest triangles have unit legs
+    uint32_t depth = 0;
+    while((1u << depth) < last)
+        ++ depth;
+
+    for(uint32_t d = 2 * depth; d -- > 0; )
+    {
+        measure(heights, d, d + 1 == 2 * depth, 0, 0, last, last, last, 0);
+        measure(heights, d, d + 1 == 2 * depth, last, last, 0, 0, 0, last);
+    }
+}
+
+// Counter clockwise triangles of grid vertex indices (row major, row 0 first)
+inline
+void Rtin::extract(float maxError, std::vector<uint32_t> &indices)
+{
+    assert(errors.size() == size * size);
+    const uint32_t last = size - 1;
+    indices.clear();
+    split(maxError, indices, 0, 0, last, last, last, 0);
+    split(maxError, indices, last, last, 0, 0, 0, last);
+}
+
+inline
+float Rtin::height(const uint16_t *heights, uint32_t x, uint32_t y) const
+{
+    const uint16_t sample = heights[y * size + x];
+    return sample == 32768 ? 0.0f : sample;
+}
+
+inline
+void Rtin::measure(const uint16_t *heights, uint32_t depth, bool leaf, uint32_t ax, uint32_t ay, uint32_t bx, uint32_t by, uint32_t cx, uint32_t cy)
+{
+    const uint32_t mx = (ax + bx) >> 1;
+    const uint32_t my = (ay + by) >> 1;
+    if(depth)
+    {
+        measure(heights, depth - 1, leaf, cx, cy, ax, ay, mx, my);
+        measure(heights, depth - 1, leaf, bx, by, cx, cy, mx, my);
+        return;
+    }
+
+    float error = std::abs((height(heights, ax, ay) + height(heights, bx, by)) / 2.0f - height(heights, mx, my));
+    if(!leaf)
+        error = std::max(error, std::max(errors[((ay + cy) >> 1) * size + ((ax + cx) >> 1)], errors[((by + cy) >> 1) * size + ((bx + cx) >> 1)]));
+
+    float &middle = errors[my * size + mx];
+    middle = std::max(middle, error);
+}
+
+inline
+void Rtin::split(float maxError, std::vector<uint32_t> &indices, uint32_t ax, uint32_t ay, uint32_t bx, uint32_t by, uint32_t cx, uint32_t cy) const
+{
+    const uint32_t mx = (ax + bx) >> 1;
+    const uint32_t my = (ay + by) >> 1;
+    if((ax > cx ? ax - cx : cx - ax) + (ay > cy ? ay - cy : cy - ay) > 1 && errors[my * size + mx] > maxError)
+    {
+        split(maxError, indices, cx, cy, ax, ay, mx, my);
+        split(maxError, indices, bx, by, cx, cy, mx, my);
+        return;
+    }
+
+    indices.push_back(ay * size + ax);
+    indices.push_back(cy * size + cx);
+    indices.push_back(by * size + bx);
+}
+
+} // namespace mesh
+
+} // namespace terrain
+
+#endif // __MESH_RTIN_H__
@@ -59,33 +59,48 @@ inline
 void Movement::move(void)
 {
     const double speed = glfwGetKey(engine.gl.window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS ? 100000.0 : 1000.0;
+    bool moved = false;
     if(glfwGetKey(engine.gl.window, GLFW_KEY_W) == GLFW_PRESS)
+    {
         engine.local.d3d.eye += engine.local.d3d.direction * speed;
+        moved = true;
+    }
 
     if(glfwGetKey(engine.gl.window, GLFW_KEY_S) == GLFW_PRESS)
+    {
         engine.local.d3d.eye -= engine.local.d3d.direction * speed;
+        moved = true;
+    }
 
     if(glfwGetKey(engine.gl.window, GLFW_KEY_D) == GLFW_PRESS)
+    {
         engine.local.d3d.eye -= engine.local.d3d.right * speed;
+        moved = true;
+    }
 
     if(glfwGetKey(engine.gl.window, GLFW_KEY_A) == GLFW_PRESS)
+    {
         engine.local.d3d.eye += engine.local.d3d.right * speed;
+        moved = true;
+    }
 
     if(glfwGetKey(engine.gl.window, GLFW_KEY_Q) == GLFW_PRESS)
     {
         engine.local.d3d.right  = glm::rotate(engine.local.d3d.right, -M_PI / 180.0, engine.local.d3d.direction);
         engine.local.d3d.up     = glm::rotate(engine.local.d3d.up, -M_PI / 180.0, engine.local.d3d.direction);
+        moved = true;
     }
 
     if(glfwGetKey(engine.gl.window, GLFW_KEY_E) == GLFW_PRESS)
     {
         engine.local.d3d.right  = glm::rotate(engine.local.d3d.right, M_PI / 180.0, engine.local.d3d.direction);
         engine.local.d3d.up     = glm::rotate(engine.local.d3d.up, M_PI / 180.0, engine.local.d3d.direction);
+        moved = true;
     }
 
-
-
-    engine.updateView();
+    // Loader is woken up by view changes only
+    if(moved)
+        engine.updateView();
 }
 
 void Movement::stop(void)
@@ -0,0 +1,154 @@
+/* 2014
+ * Maciej Szeptuch
+ * II UWr
+ */
+#include "defines.h"
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <unistd.h>
+
+#include "libs/logger/logger.h"
+
+using namespace std;
+
+#include "hgt/file.h"
+#include "hgt/convert.h"
+#include "hgt/archive.h"
+
+using namespace terrain;
+
+Log     debug;
+Logger  logger(debug, "PACKER");
+
+void pack(const char *output, bool converted, int count, char **paths);
+void writePadding(FILE *file, uint64_t offset);
+
+int main(int argc, char **argv)
+{
+    debug.setLevel(Log::DEBUG);
+
+    bool converted = false;
+    for(int opt = 0; (opt = getopt(argc, argv, "c")) != -1; )
+        switch(opt)
+        {
+            case 'c':
+                converted = true;
+                break;
+
+            default:
+                optind = argc;
+                break;
+        }
+
+    if(argc - optind < 2)
+    {
+        fprintf(stderr, "Usage: %s [-c] archive.hgta maps...\n", argv[0]);
+        fprintf(stderr, "  -c  store samples already converted for the terrain engine\n");
+        return 1;
+    }
+
+    try
+    {
+        pack(argv[optind], converted, argc - optind - 1, argv + optind + 1);
+    }
+    catch(const exception &err)
+    {
+        logger.critical("Error packing maps: %s", err.what());
+        return 3;
+    }
+
+    return 0;
+}
+
+void pack(const char *output, bool converted, int count, char **paths)
+{
+    vector<hgt::ArchiveEntry>   entries(count);
+    vector<const char *>        sources(count);
+    for(int p = 0; p < count; ++ p)
+    {
+        char parse[1024]    = {},
+             *filename      = nullptr;
+
+        int32_t lat = 0,
+                lon = 0;
+
+        strncpy(parse, paths[p], 1023);
+        hgt::parseFilename(parse, filename, lat, lon);
+        entries[p].lat      = lat;
+        entries[p].lon      = lon;
+        entries[p].reserved = p; // source index until sorted
+    }
+
+    sort(entries.begin(), entries.end());
+    hgt::ArchiveHeader header = {};
+    memcpy(header.magic, hgt::ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version  = hgt::ARCHIVE_VERSION;
+    header.flags    = converted ? hgt::ARCHIVE_CONVERTED : 0;
+    header.count    = count;
+    header.minLat   = header.maxLat = entries[0].lat;
+    header.minLon   = header.maxLon = entries[0].lon;
+
+    uint64_t offset = hgt::archiveAlign(sizeof(hgt::ArchiveHeader) + count * sizeof(hgt::ArchiveEntry));
+    for(int e = 0; e < count; ++ e)
+    {
+        if(e && entries[e].lat == entries[e - 1].lat && entries[e].lon == entries[e - 1].lon)
+            throw runtime_error("Duplicate map square");
+
+        sources[e]          = paths[entries[e].reserved];
+        entries[e].reserved = 0;
+        entries[e].offset   = offset;
+        offset = hgt::archiveAlign(offset + hgt::FILE_SIZE);
+
+        header.minLat = min(header.minLat, entries[e].lat);
+        header.maxLat = max(header.maxLat, entries[e].lat);
+        header.minLon = min(header.minLon, entries[e].lon);
+        header.maxLon = max(header.maxLon, entries[e].lon);
+    }
+
+    logger.info("Packing %d maps into %s (%.2lf MB)%s", count, output, offset / 1048576.0, converted ? ", converted" : "");
+    FILE *file = fopen(output, "wb");
+    if(!file)
+        throw runtime_error("Couldn't create archive file");
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(&entries[0], sizeof(hgt::ArchiveEntry), count, file);
+    writePadding(file, entries[0].offset);
+
+    vector<int16_t> samples(hgt::SAMPLES * hgt::SAMPLES);
+    for(int e = 0; e < count; ++ e)
+    {
+        logger.debug("Packing %s square (%d %d)", sources[e], entries[e].lon, entries[e].lat);
+        hgt::File map(sources[e]);
+        const int16_t *data = map.getData();
+        if(converted)
+        {
+            hgt::convert(&samples[0], data, samples.size());
+            data = &samples[0];
+        }
+
+        if(fwrite(data, 1, hgt::FILE_SIZE, file) != hgt::FILE_SIZE)
+        {
+            fclose(file);
+            throw runtime_error("Couldn't write archive file");
+        }
+
+        writePadding(file, hgt::archiveAlign(entries[e].offset + hgt::FILE_SIZE));
+    }
+
+    if(fclose(file))
+        throw runtime_error("Couldn't write archive file");
+
+    logger.info("Packed %d maps", count);
+}
+
+void writePadding(FILE *file, uint64_t offset)
+{
+    static const char zero[hgt::ARCHIVE_ALIGNMENT] = {};
+    uint64_t position = ftell(file);
+    assert(position <= offset && offset - position < hgt::ARCHIVE_ALIGNMENT);
+    fwrite(zero, 1, offset - position, file);
+}
@@ -0,0 +1,151 @@
+/* 2014
+ * Maciej Szeptuch
+ * II UWr
+ */
+#include "defines.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+#include "libs/logger/logger.h"
+
+using namespace std;
+
+#include "projection/mercator.h"
+#include "projection/batch.h"
+
+using namespace terrain;
+using namespace terrain::projection;
+
+Log     debug;
+Logger  logger(debug, "PROJBENCH");
+
+void metToLatSeries(double *lat, const double *y, size_t count);
+void metToLatFloat(double *lat, const double *y, size_t count);
+void metToLatReference(double *lat, const double *y, size_t count);
+double measure(mercator::Projector kernel, double *lat, const double *y, size_t count, int rounds);
+
+// Latitude kernels against the iterative solution over the whole map height:
+// the batch kernels, the scalar series and the series in single precision,
+// the way a shader would evaluate it
+int main(int argc, char **argv)
+{
+    debug.setLevel(Log::DEBUG);
+
+    int rows    = 1 << 20;
+    int rounds  = 10;
+    for(int opt = 0; (opt = getopt(argc, argv, "n:r:")) != -1; )
+        switch(opt)
+        {
+            case 'n':
+                rows = max(1024, atoi(optarg));
+                break;
+
+            case 'r':
+                rounds = max(1, atoi(optarg));
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-n rows] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+
+    struct Kernel
+    {
+        const char          *name;
+        mercator::Projector kernel;
+        bool                supported;
+    } kernels[] = {
+        {"series",  metToLatSeries,             true},
+        {"float",   metToLatFloat,              true},
+        {"scalar",  mercator::metToLatScalar,   true},
+#ifdef MERCATOR_BATCH_X86
+        {"SSE2",    mercator::metToLatSSE2,     __builtin_cpu_supports("sse2") != 0},
+        {"AVX2",    mercator::metToLatAVX2,     __builtin_cpu_supports("avx2") != 0 && __builtin_cpu_supports("fma") != 0},
+#endif // MERCATOR_BATCH_X86
+    };
+
+    const size_t count = rows;
+    vector<double> y(count);
+    vector<double> lat(count);
+    vector<double> expected(count);
+    for(size_t i = 0; i < count; ++ i)
+        y[i] = -MERCATOR_BOUNDS + 2.0 * MERCATOR_BOUNDS * i / (count - 1);
+
+    const double iterative = measure(metToLatReference, expected.data(), y.data(), count, 1);
+    logger.info("%zu rows, iterative: %.2lf Mrows/s", count, iterative);
+    for(const Kernel &kernel: kernels)
+    {
+        if(!kernel.supported)
+        {
+            logger.info("  %s: not supported", kernel.name);
+            continue;
+        }
+
+        const double rate = measure(kernel.kernel, lat.data(), y.data(), count, rounds);
+        double error = 0.0;
+        for(size_t i = 0; i < count; ++ i)
+            error = max(error, fabs(lat[i] - expected[i]));
+
+        logger.info("  %s: %.2lf Mrows/s (%.1lfx iterative), max error: %.3g deg (%.3g m)",
+            kernel.name, rate, rate / iterative, error, error * M_PI / 180.0 * mercator::EQUATORIAL_RADIUS);
+    }
+
+    return 0;
+}
+
+void metToLatSeries(double *lat, const double *y, size_t count)
+{
+    for(size_t i = 0; i < count; ++ i)
+        lat[i] = mercator::metToLat(y[i]);
+}
+
+// mercator::metToLat with float arithmetic and constants
+void metToLatFloat(double *lat, const double *y, size_t count)
+{
+    const float radius  = mercator::EQUATORIAL_RADIUS;
+    const float a2      = mercator::A2;
+    const float a4      = mercator::A4;
+    const float a6      = mercator::A6;
+    const float a8      = mercator::A8;
+    for(size_t i = 0; i < count; ++ i)
+    {
+        const float t       = exp(-(float) y[i] / radius);
+        const float t2      = t * t;
+        const float sinChi  = (1.0f - t2) / (1.0f + t2);
+        const float cosChi  = 2.0f * t / (1.0f + t2);
+        const float sin2    = 2.0f * sinChi * cosChi;
+        const float cos2    = 2.0f * (cosChi * cosChi - sinChi * sinChi);
+        const float b4      = a8;
+        const float b3      = a6 + cos2 * b4;
+        const float b2      = a4 + cos2 * b3 - b4;
+        const float b1      = a2 + cos2 * b2 - b3;
+        lat[i] = 180.0f * ((float) M_PI_2 - 2.0f * atan(t) + sin2 * b1) / (float) M_PI;
+    }
+}
+
+void metToLatReference(double *lat, const double *y, size_t count)
+{
+    for(size_t i = 0; i < count; ++ i)
+        lat[i] = mercator::metToLatIterative(y[i]);
+}
+
+// Best of the rounds, rows per second in millions
+double measure(mercator::Projector kernel, double *lat, const double *y, size_t count, int rounds)
+{
+    kernel(lat, y, count);
+
+    double best = 1e9;
+    for(int r = 0; r < rounds; ++ r)
+    {
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        kernel(lat, y, count);
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+
+    return count / best / 1e6;
+}
@@ -0,0 +1,233 @@
+/*
+ * Elliptical Mercator over arrays of coordinates, the vector kernels follow
+ * the scalar series of mercator::metToLat with exp and atan (Cephes) inlined
+ */
+#ifndef __MERCATOR_BATCH_H__
+#define __MERCATOR_BATCH_H__
+
+#include <cstddef>
+#include <cmath>
+
+#include "projection/mercator.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define MERCATOR_BATCH_X86 true
+#endif // __x86_64__ || __i386__
+
+namespace terrain
+{
+
+namespace projection
+{
+
+namespace mercator
+{
+
+// Latitudes (degrees) of y (meters), destination may be the source
+typedef void (*Projector)(double *lat, const double *y, size_t count);
+
+inline
+void metToLatScalar(double *lat, const double *y, size_t count)
+{
+    for(size_t s = 0; s < count; ++ s)
+        lat[s] = metToLat(y[s]);
+}
+
+#ifdef MERCATOR_BATCH_X86
+// exp (Cephes, Pade form) for |x| < 700, 2^n assembled in the exponent bits
+__attribute__((target("sse2")))
+inline
+__m128d expSSE2(__m128d x)
+{
+    const __m128d n     = _mm_cvtepi32_pd(_mm_cvtpd_epi32(_mm_mul_pd(x, _mm_set1_pd(M_LOG2E))));
+    x = _mm_sub_pd(x, _mm_mul_pd(n, _mm_set1_pd(6.93145751953125E-1)));
+    x = _mm_sub_pd(x, _mm_mul_pd(n, _mm_set1_pd(1.42860682030941723212E-6)));
+
+    const __m128d xx    = _mm_mul_pd(x, x);
+    __m128d p = _mm_add_pd(_mm_mul_pd(xx, _mm_set1_pd(1.26177193074810590878E-4)), _mm_set1_pd(3.02994407707441961300E-2));
+    p = _mm_mul_pd(x, _mm_add_pd(_mm_mul_pd(xx, p), _mm_set1_pd(9.99999999999999999910E-1)));
+    __m128d q = _mm_add_pd(_mm_mul_pd(xx, _mm_set1_pd(3.00198505138664455042E-6)), _mm_set1_pd(2.52448340349684104192E-3));
+    q = _mm_add_pd(_mm_mul_pd(xx, q), _mm_set1_pd(2.27265548208155028766E-1));
+    q = _mm_add_pd(_mm_mul_pd(xx, q), _mm_set1_pd(2.00000000000000000009E0));
+    x = _mm_add_pd(_mm_set1_pd(1.0), _mm_mul_pd(_mm_set1_pd(2.0), _mm_div_pd(p, _mm_sub_pd(q, p))));
+
+    // n + 1023 lands in the low mantissa bits, shifted up into the exponent
+    const __m128d biased = _mm_add_pd(n, _mm_set1_pd(1023.0 + 6755399441055744.0));
+    return _mm_mul_pd(x, _mm_castsi128_pd(_mm_slli_epi64(_mm_castpd_si128(biased), 52)));
+}
+
+// atan (Cephes) for x > 0
+__attribute__((target("sse2")))
+inline
+__m128d atanSSE2(__m128d x)
+{
+    const __m128d large = _mm_cmpgt_pd(x, _mm_set1_pd(2.41421356237309504880));
+    const __m128d mid   = _mm_andnot_pd(large, _mm_cmpgt_pd(x, _mm_set1_pd(0.66)));
+    const __m128d y0    = _mm_or_pd(_mm_and_pd(large, _mm_set1_pd(M_PI_2)), _mm_and_pd(mid, _mm_set1_pd(M_PI_4)));
+    x = _mm_or_pd(_mm_or_pd(
+        _mm_and_pd(large, _mm_div_pd(_mm_set1_pd(-1.0), x)),
+        _mm_and_pd(mid, _mm_div_pd(_mm_sub_pd(x, _mm_set1_pd(1.0)), _mm_add_pd(x, _mm_set1_pd(1.0))))),
+        _mm_andnot_pd(_mm_or_pd(large, mid), x));
+
+    const __m128d z = _mm_mul_pd(x, x);
+    __m128d p = _mm_add_pd(_mm_mul_pd(z, _mm_set1_pd(-8.750608600031904122785E-1)), _mm_set1_pd(-1.615753718733365076637E1));
+    p = _mm_add_pd(_mm_mul_pd(z, p), _mm_set1_pd(-7.500855792314704667340E1));
+    p = _mm_add_pd(_mm_mul_pd(z, p), _mm_set1_pd(-1.228866684490136173410E2));
+    p = _mm_add_pd(_mm_mul_pd(z, p), _mm_set1_pd(-6.485021904942025371773E1));
+    __m128d q = _mm_add_pd(z, _mm_set1_pd(2.485846490142306297962E1));
+    q = _mm_add_pd(_mm_mul_pd(z, q), _mm_set1_pd(1.650270098316988542046E2));
+    q = _mm_add_pd(_mm_mul_pd(z, q), _mm_set1_pd(4.328810604912902668951E2));
+    q = _mm_add_pd(_mm_mul_pd(z, q), _mm_set1_pd(4.853903996359136964868E2));
+    q = _mm_add_pd(_mm_mul_pd(z, q), _mm_set1_pd(1.945506571482613964425E2));
+    return _mm_add_pd(y0, _mm_add_pd(x, _mm_mul_pd(_mm_mul_pd(x, z), _mm_div_pd(p, q))));
+}
+
+__attribute__((target("sse2")))
+inline
+void metToLatSSE2(double *lat, const double *y, size_t count)
+{
+    const __m128d one   = _mm_set1_pd(1.0);
+    const __m128d two   = _mm_set1_pd(2.0);
+    size_t s = 0;
+    for(; s + 2 <= count; s += 2)
+    {
+        const __m128d t         = expSSE2(_mm_mul_pd(_mm_loadu_pd(y + s), _mm_set1_pd(-1.0 / EQUATORIAL_RADIUS)));
+        const __m128d t2        = _mm_mul_pd(t, t);
+        const __m128d inverse   = _mm_div_pd(one, _mm_add_pd(one, t2));
+        const __m128d sinChi    = _mm_mul_pd(_mm_sub_pd(one, t2), inverse);
+        const __m128d cosChi    = _mm_mul_pd(_mm_mul_pd(two, t), inverse);
+        const __m128d sin2      = _mm_mul_pd(two, _mm_mul_pd(sinChi, cosChi));
+        const __m128d cos2      = _mm_mul_pd(two, _mm_sub_pd(_mm_mul_pd(cosChi, cosChi), _mm_mul_pd(sinChi, sinChi)));
+        const __m128d b4        = _mm_set1_pd(A8);
+        const __m128d b3        = _mm_add_pd(_mm_set1_pd(A6), _mm_mul_pd(cos2, b4));
+        const __m128d b2        = _mm_sub_pd(_mm_add_pd(_mm_set1_pd(A4), _mm_mul_pd(cos2, b3)), b4);
+        const __m128d b1        = _mm_sub_pd(_mm_add_pd(_mm_set1_pd(A2), _mm_mul_pd(cos2, b2)), b3);
+        const __m128d phi       = _mm_add_pd(_mm_sub_pd(_mm_set1_pd(M_PI_2), _mm_mul_pd(two, atanSSE2(t))), _mm_mul_pd(sin2, b1));
+        _mm_storeu_pd(lat + s, _mm_mul_pd(phi, _mm_set1_pd(180.0 / M_PI)));
+    }
+
+    metToLatScalar(lat + s, y + s, count - s);
+}
+
+__attribute__((target("avx2,fma")))
+inline
+__m256d expAVX2(__m256d x)
+{
+    const __m256d n     = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(M_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_fnmadd_pd(n, _mm256_set1_pd(6.93145751953125E-1), x);
+    x = _mm256_fnmadd_pd(n, _mm256_set1_pd(1.42860682030941723212E-6), x);
+
+    const __m256d xx    = _mm256_mul_pd(x, x);
+    __m256d p = _mm256_fmadd_pd(xx, _mm256_set1_pd(1.26177193074810590878E-4), _mm256_set1_pd(3.02994407707441961300E-2));
+    p = _mm256_mul_pd(x, _mm256_fmadd_pd(xx, p, _mm256_set1_pd(9.99999999999999999910E-1)));
+    __m256d q = _mm256_fmadd_pd(xx, _mm256_set1_pd(3.00198505138664455042E-6), _mm256_set1_pd(2.52448340349684104192E-3));
+    q = _mm256_fmadd_pd(xx, q, _mm256_set1_pd(2.27265548208155028766E-1));
+    q = _mm256_fmadd_pd(xx, q, _mm256_set1_pd(2.00000000000000000009E0));
+    x = _mm256_fmadd_pd(_mm256_set1_pd(2.0), _mm256_div_pd(p, _mm256_sub_pd(q, p)), _mm256_set1_pd(1.0));
+
+    const __m256d biased = _mm256_add_pd(n, _mm256_set1_pd(1023.0 + 6755399441055744.0));
+    return _mm256_mul_pd(x, _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(biased), 52)));
+}
+
+__attribute__((target("avx2,fma")))
+inline
+__m256d atanAVX2(__m256d x)
+{
+    const __m256d large = _mm256_cmp_pd(x, _mm256_set1_pd(2.41421356237309504880), _CMP_GT_OQ);
+    const __m256d mid   = _mm256_andnot_pd(large, _mm256_cmp_pd(x, _mm256_set1_pd(0.66), _CMP_GT_OQ));
+    __m256d y0 = _mm256_blendv_pd(_mm256_setzero_pd(), _mm256_set1_pd(M_PI_4), mid);
+    y0 = _mm256_blendv_pd(y0, _mm256_set1_pd(M_PI_2), large);
+    x = _mm256_blendv_pd(x, _mm256_div_pd(_mm256_sub_pd(x, _mm256_set1_pd(1.0)), _mm256_add_pd(x, _mm256_set1_pd(1.0))), mid);
+    x = _mm256_blendv_pd(x, _mm256_div_pd(_mm256_set1_pd(-1.0), x), large);
+
+    const __m256d z = _mm256_mul_pd(x, x);
+    __m256d p = _mm256_fmadd_pd(z, _mm256_set1_pd(-8.750608600031904122785E-1), _mm256_set1_pd(-1.615753718733365076637E1));
+    p = _mm256_fmadd_pd(z, p, _mm256_set1_pd(-7.500855792314704667340E1));
+    p = _mm256_fmadd_pd(z, p, _mm256_set1_pd(-1.228866684490136173410E2));
+    p = _mm256_fmadd_pd(z, p, _mm256_set1_pd(-6.485021904942025371773E1));
+    __m256d q = _mm256_add_pd(z, _mm256_set1_pd(2.485846490142306297962E1));
+    q = _mm256_fmadd_pd(z, q, _mm256_set1_pd(1.650270098316988542046E2));
+    q = _mm256_fmadd_pd(z, q, _mm256_set1_pd(4.328810604912902668951E2));
+    q = _mm256_fmadd_pd(z, q, _mm256_set1_pd(4.853903996359136964868E2));
+    q = _mm256_fmadd_pd(z, q, _mm256_set1_pd(1.945506571482613964425E2));
+    return _mm256_add_pd(y0, _mm256_fmadd_pd(_mm256_mul_pd(x, z), _mm256_div_pd(p, q), x));
+}
+
+__attribute__((target("avx2,fma")))
+inline
+void metToLatAVX2(double *lat, const double *y, size_t count)
+{
+    const __m256d one   = _mm256_set1_pd(1.0);
+    const __m256d two   = _mm256_set1_pd(2.0);
+    size_t s = 0;
+    for(; s + 4 <= count; s += 4)
+    {
+        const __m256d t         = expAVX2(_mm256_mul_pd(_mm256_loadu_pd(y + s), _mm256_set1_pd(-1.0 / EQUATORIAL_RADIUS)));
+        const __m256d t2        = _mm256_mul_pd(t, t);
+        const __m256d inverse   = _mm256_div_pd(one, _mm256_add_pd(one, t2));
+        const __m256d sinChi    = _mm256_mul_pd(_mm256_sub_pd(one, t2), inverse);
+        const __m256d cosChi    = _mm256_mul_pd(_mm256_mul_pd(two, t), inverse);
+        const __m256d sin2      = _mm256_mul_pd(two, _mm256_mul_pd(sinChi, cosChi));
+        const __m256d cos2      = _mm256_mul_pd(two, _mm256_fmsub_pd(cosChi, cosChi, _mm256_mul_pd(sinChi, sinChi)));
+        const __m256d b4        = _mm256_set1_pd(A8);
+        const __m256d b3        = _mm256_fmadd_pd(cos2, b4, _mm256_set1_pd(A6));
+        const __m256d b2        = _mm256_sub_pd(_mm256_fmadd_pd(cos2, b3, _mm256_set1_pd(A4)), b4);
+        const __m256d b1        = _mm256_sub_pd(_mm256_fmadd_pd(cos2, b2, _mm256_set1_pd(A2)), b3);
+        const __m256d phi       = _mm256_fmadd_pd(sin2, b1, _mm256_fnmadd_pd(two, atanAVX2(t), _mm256_set1_pd(M_PI_2)));
+        _mm256_storeu_pd(lat + s, _mm256_mul_pd(phi, _mm256_set1_pd(180.0 / M_PI)));
+    }
+
+    metToLatScalar(lat + s, y + s, count - s);
+}
+#endif // MERCATOR_BATCH_X86
+
+// Picks the widest kernel supported by the running CPU
+inline
+Projector projector(const char **name = nullptr)
+{
+    const char *_name       = "scalar";
+    Projector   kernel      = metToLatScalar;
+
+#ifdef MERCATOR_BATCH_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        _name   = "AVX2";
+        kernel  = metToLatAVX2;
+    }
+
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        _name   = "SSE2";
+        kernel  = metToLatSSE2;
+    }
+#endif // MERCATOR_BATCH_X86
+
+    if(name)
+        *name = _name;
+
+    return kernel;
+}
+
+inline
+void metToLat(double *lat, const double *y, size_t count)
+{
+    static const Projector kernel = projector();
+    kernel(lat, y, count);
+}
+
+inline
+void metToLon(double *lon, const double *x, size_t count)
+{
+    for(size_t s = 0; s < count; ++ s)
+        lon[s] = x[s] * (180.0 / M_PI / EQUATORIAL_RADIUS);
+}
+
+} // namespace mercator
+
+} // namespace projection
+
+} // namespace terrain
+
+#endif // __MERCATOR_BATCH_H__
@@ -22,6 +22,13 @@ static const double RADIUS_RATIO         = POLAR_RADIUS / EQUATORIAL_RADIUS;
 static const double ECCENT               = sqrt(1.0 - RADIUS_RATIO * RADIUS_RATIO);
 static const double COM                  = 0.5 * ECCENT;
 
+// Conformal to geodetic latitude series, Snyder (Map Projections) eq. 3-5
+static const double E2                   = ECCENT * ECCENT;
+static const double A2                   = E2 / 2.0 + 5.0 * E2 * E2 / 24.0 + E2 * E2 * E2 / 12.0 + 13.0 * E2 * E2 * E2 * E2 / 360.0;
+static const double A4                   = 7.0 * E2 * E2 / 48.0 + 29.0 * E2 * E2 * E2 / 240.0 + 811.0 * E2 * E2 * E2 * E2 / 11520.0;
+static const double A6                   = 7.0 * E2 * E2 * E2 / 120.0 + 81.0 * E2 * E2 * E2 * E2 / 1120.0;
+static const double A8                   = 4279.0 * E2 * E2 * E2 * E2 / 161280.0;
+
 inline
 double lonToMet(double lon)
 {
@@ -44,8 +51,27 @@ double metToLon(double x)
     return 180.0 * x / EQUATORIAL_RADIUS / M_PI;
 }
 
+// Conformal latitude chi = pi/2 - 2 atan(t), t = exp(-y / R), whose sine
+// and cosine are rational in t, the series summed by Clenshaw on cos 2chi
 inline
 double metToLat(double y)
+{
+    const double t      = exp(-y / EQUATORIAL_RADIUS);
+    const double t2     = t * t;
+    const double sinChi = (1.0 - t2) / (1.0 + t2);
+    const double cosChi = 2.0 * t / (1.0 + t2);
+    const double sin2   = 2.0 * sinChi * cosChi;
+    const double cos2   = 2.0 * (cosChi * cosChi - sinChi * sinChi);
+    const double b4     = A8;
+    const double b3     = A6 + cos2 * b4;
+    const double b2     = A4 + cos2 * b3 - b4;
+    const double b1     = A2 + cos2 * b2 - b3;
+    return 180.0 * (M_PI_2 - 2.0 * atan(t) + sin2 * b1) / M_PI;
+}
+
+// Fixed point iteration the series replaced, the reference to check it against
+inline
+double metToLatIterative(double y)
 {
     double ts    = exp(-y / EQUATORIAL_RADIUS);
     double phi   = M_PI_2 - 2.0 * atan(ts);
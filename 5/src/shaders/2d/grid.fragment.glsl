@@ -1,6 +1,14 @@
 #version 120
 
+varying vec2 cell;
+
 void main()
 {
-    gl_FragColor = vec4(0.33, 0.34, 0.32, 1.0);
+    // Pixels to the nearest line, faded out over one
+    vec2 lines = abs(fract(cell + 0.5) - 0.5) / fwidth(cell);
+    float alpha = 1.0 - min(min(lines.x, lines.y), 1.0);
+    if(alpha <= 0.0)
+        discard;
+
+    gl_FragColor = vec4(0.33, 0.34, 0.32, alpha);
 }
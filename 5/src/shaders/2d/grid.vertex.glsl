@@ -2,10 +2,15 @@
 
 uniform mat4 MVP;
 
-attribute vec3 vertexPosition;
+// Map in view, in grid cells from a line: left, right, bottom, top
+uniform vec4 grid;
+
+attribute vec2 vertexPosition;
+
+varying vec2 cell;
 
 void main()
 {
-    vec4 vertex = vec4(vertexPosition, 1.0);
-    gl_Position = MVP * vertex;
+    cell = mix(grid.xz, grid.yw, vertexPosition * 0.5 + 0.5);
+    gl_Position = MVP * vec4(cell, 0.0, 1.0);
 }
@@ -0,0 +1,55 @@
+#version 120
+#extension GL_EXT_gpu_shader4: enable
+#extension GL_EXT_texture_array: enable
+
+// Tile heights by layer
+uniform usampler2DArray heights;
+
+varying vec2 grid;
+flat varying ivec2 tile;
+
+vec4 getColor(ivec2 sample)
+{
+    float ht = float(texelFetch2DArray(heights, ivec3(sample, tile.x), 0).r) - 1000.0;
+    if(ht < 0.0)
+        return vec4(0.0, 0.0, 1.0, 1.0);
+
+    else if(ht < 500.0)
+        return vec4(0.0, ht / 500.0, 0.0, 1.0);
+
+    else if(ht < 1000.0)
+        return vec4(ht / 500.0 - 1.0, 1.0, 0.0, 1.0);
+
+    else if(ht < 1500.0)
+        return vec4(1.0, 2.0 - ht / 500.0, 0.0, 1.0);
+
+    else if(ht < 10000.0)
+        return vec4(1.0, 1.0, 1.0, 1.0);
+
+    return vec4(0.0, 0.0, 0.0, 0.0);
+}
+
+// Cell of the tile's level, its colours blended over the same two triangles
+// as the mesh would, split along the rising diagonal
+void main()
+{
+    int step = 1 << tile.y;
+    vec2 cell = grid / float(step);
+    ivec2 corner = clamp(ivec2(floor(cell)), ivec2(0), ivec2(1024 / step - 1));
+    vec2 f = cell - vec2(corner);
+    corner *= step;
+
+    vec4 right = getColor(corner + ivec2(step, 0));
+    vec4 top = getColor(corner + ivec2(0, step));
+    if(f.x + f.y <= 1.0)
+    {
+        vec4 origin = getColor(corner);
+        gl_FragColor = origin + f.x * (right - origin) + f.y * (top - origin);
+    }
+
+    else
+    {
+        vec4 opposite = getColor(corner + ivec2(step, step));
+        gl_FragColor = opposite + (1.0 - f.x) * (top - opposite) + (1.0 - f.y) * (right - opposite);
+    }
+}
@@ -0,0 +1,36 @@
+#version 120
+#extension GL_EXT_gpu_shader4: enable
+#extension GL_ARB_uniform_buffer_object: enable
+
+uniform mat4 MVP;
+uniform int first;
+
+// Box, (height layer, trig row, level), side levels (bottom, right, top, left)
+struct Instance
+{
+    vec4    box;
+    ivec4   data;
+    ivec4   edges;
+};
+
+layout(std140) uniform Instances
+{
+    Instance instances[9];
+};
+
+attribute vec2 vertexPosition;
+
+// Position in the tile's samples, its height layer and level
+varying vec2 grid;
+flat varying ivec2 tile;
+
+void main()
+{
+    Instance instance = instances[first + gl_InstanceID];
+    vec2 corner = vertexPosition * 0.5 + 0.5;
+    grid = corner * 1024.0;
+    tile = instance.data.xz;
+
+    // At sea level, above the background grid
+    gl_Position = MVP * vec4(mix(instance.box.xz, instance.box.yw, corner), 1000.0, 1.0);
+}
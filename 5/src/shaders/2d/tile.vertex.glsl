@@ -1,24 +1,72 @@
 #version 120
 #extension GL_EXT_gpu_shader4: enable
+#extension GL_EXT_texture_array: enable
+#extension GL_ARB_uniform_buffer_object: enable
 
-uniform vec4 box;
 uniform mat4 MVP;
+uniform int first;
 
-attribute float height;
+// Tile heights by layer
+uniform usampler2DArray heights;
+
+// Box, (height layer, trig row, level), side levels (bottom, right, top, left)
+struct Instance
+{
+    vec4    box;
+    ivec4   data;
+    ivec4   edges;
+};
+
+layout(std140) uniform Instances
+{
+    Instance instances[9];
+};
+
+attribute vec2 vertexPosition;
 
 varying vec4 fragmentColor;
 
+float sampleHeight(Instance tile, ivec2 grid)
+{
+    return float(texelFetch2DArray(heights, ivec3(grid, tile.data.x), 0).r);
+}
+
+vec4 getVertex(Instance tile, ivec2 grid)
+{
+    float height = sampleHeight(tile, grid);
+    if(height == 32768.0)
+        height = 0.0;
+
+    return vec4(
+        tile.box.x + (tile.box.y - tile.box.x) * float(grid.x) / 1024.0,
+        tile.box.z + (tile.box.w - tile.box.z) * float(grid.y) / 1024.0,
+        height, 1.0);
+}
+
 void main()
 {
-    int y = gl_VertexID / 1025;
-    int x = gl_VertexID - y * 1025;
-    vec4 vertex = vec4(x, y, height, 1);
-    vertex.x = box.x + (box.y - box.x) * vertex.x / 1024.0;
-    vertex.y = box.z + (box.w - box.z) * vertex.y / 1024.0;
-    if(vertex.z == 32768.0)
-        vertex.z = 0;
-
-    gl_Position = MVP * vertex;
+    Instance tile = instances[first + gl_InstanceID];
+    ivec2 grid = ivec2(vertexPosition);
+
+    // Side vertices between the samples of a coarser neighbour are moved onto its edge
+    int side = grid.y == 0 ? 0 : grid.x == 1024 ? 1 : grid.y == 1024 ? 2 : grid.x == 0 ? 3 : -1;
+    ivec2 other = grid;
+    float weight = 0.0;
+    if(side >= 0)
+    {
+        int step = 1 << tile.edges[side];
+        ivec2 along = side == 0 || side == 2 ? ivec2(1, 0) : ivec2(0, 1);
+        int offset = (along.x * grid.x + along.y * grid.y) % step;
+        if(offset > 0)
+        {
+            grid -= along * offset;
+            other = grid + along * step;
+            weight = float(offset) / float(step);
+        }
+    }
+
+    float height = mix(sampleHeight(tile, grid), sampleHeight(tile, other), weight);
+    gl_Position = MVP * mix(getVertex(tile, grid), getVertex(tile, other), weight);
 
     float ht = height - 1000.0;
     if(ht < 0.0)
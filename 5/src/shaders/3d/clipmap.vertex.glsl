@@ -0,0 +1,90 @@
+#version 120
+#extension GL_EXT_gpu_shader4: enable
+#extension GL_EXT_texture_array: enable
+
+uniform mat4 MVP;
+
+// Texel of the first vertex in this level and in the coarser one (negative if not drawn)
+uniform ivec4 level;
+
+// Level, its height layer and trig row
+uniform int layer;
+
+// Level heights by layer, addressed by world grid index modulo the level size
+uniform usampler2DArray heights;
+
+// cos, sin of the latitude of row i and of the longitude of column i, a row per level
+uniform sampler2D trig;
+
+attribute vec2 vertexPosition;
+
+varying vec4 fragmentColor;
+
+const int   SIZE                 = 129;
+const float EQUATORIAL_RADIUS    = 6378137.0;
+
+float sampleHeight(ivec2 grid)
+{
+    return float(texelFetch2DArray(heights, ivec3((level.xy + grid) % SIZE, layer), 0).r);
+}
+
+// Even vertices of the border are coarser level samples
+float sampleCoarser(ivec2 grid)
+{
+    return float(texelFetch2DArray(heights, ivec3((level.zw + grid / 2) % SIZE, layer + 1), 0).r);
+}
+
+vec4 getVertex(ivec2 grid, float height)
+{
+    if(height == 32768.0)
+        height = 0.0;
+
+    float radius = EQUATORIAL_RADIUS + height - 1000.0;
+    vec2 lat = texelFetch2D(trig, ivec2(grid.y, layer), 0).xy;
+    vec2 lon = texelFetch2D(trig, ivec2(grid.x, layer), 0).zw;
+    return vec4(radius * lat.x * lon.x, radius * lat.x * lon.y, radius * lat.y, 1.0);
+}
+
+void main()
+{
+    ivec2 grid = ivec2(vertexPosition);
+    float height;
+
+    // Border meets the coarser level, odd vertices are moved onto its edge
+    if(level.z >= 0 && (grid.x == 0 || grid.y == 0 || grid.x == SIZE - 1 || grid.y == SIZE - 1))
+    {
+        ivec2 odd = grid % 2;
+        ivec2 other = grid + odd;
+        grid -= odd;
+
+        float first = sampleCoarser(grid);
+        float second = sampleCoarser(other);
+        height = mix(first, second, 0.5 * float(odd.x + odd.y));
+        gl_Position = MVP * mix(getVertex(grid, first), getVertex(other, second), 0.5 * float(odd.x + odd.y));
+    }
+
+    else
+    {
+        height = sampleHeight(grid);
+        gl_Position = MVP * getVertex(grid, height);
+    }
+
+    float ht = height - 1000.0;
+    if(ht < 0.0)
+        fragmentColor = vec4(0.0, 0.0, 1.0, 1.0);
+
+    else if(ht < 500.0)
+        fragmentColor = vec4(0.0, ht / 500.0, 0.0, 1.0);
+
+    else if(ht < 1000.0)
+        fragmentColor = vec4(ht / 500.0 - 1.0, 1.0, 0.0, 1.0);
+
+    else if(ht < 1500.0)
+        fragmentColor = vec4(1.0, 2.0 - ht / 500.0, 0.0, 1.0);
+
+    else if(ht < 10000.0)
+        fragmentColor = vec4(1.0, 1.0, 1.0, 1.0);
+
+    else
+        fragmentColor = vec4(0.0, 0.0, 0.0, 0.0);
+}
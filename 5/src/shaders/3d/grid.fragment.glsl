@@ -1,6 +1,48 @@
 #version 120
 
+// World relative to the eye to clip
+uniform mat4 MVP;
+
+// Eye, and its squared distance to the centre less the squared radius
+uniform vec4 eye;
+
+// Grid cells per radian of longitude, map bounds in cells
+uniform vec4 grid;
+
+varying vec3 ray;
+
+const float ECCENT  = 0.0818191909289069;
+
+float artanh(float x)
+{
+    return 0.5 * log((1.0 + x) / (1.0 - x));
+}
+
 void main()
 {
-    gl_FragColor = vec4(0.33, 0.34, 0.32, 1.0);
+    // Nearest hit of the sphere, the root without cancellation
+    vec3 direction = normalize(ray);
+    float b = dot(eye.xyz, direction);
+    float d = b * b - eye.w;
+    float t = eye.w / (sqrt(max(d, 0.0)) - b);
+    vec3 hit = direction * t;
+    vec3 point = eye.xyz + hit;
+
+    // Mercator cells, longitude also wrapped on the opposite meridian so
+    // its derivatives have no seam
+    float lon = atan(point.y, point.x);
+    float across = atan(-point.y, -point.x);
+    float s = clamp(point.z / length(point), -0.9999, 0.9999);
+    vec2 cell = grid.x * vec2(lon, artanh(s) - ECCENT * artanh(ECCENT * s));
+    vec2 width = vec2(grid.x * min(fwidth(lon), fwidth(across)), fwidth(cell.y));
+
+    // Pixels to the nearest line, faded out over one
+    vec2 lines = abs(fract(cell + 0.5) - 0.5) / max(width, vec2(1e-6));
+    float alpha = 1.0 - min(min(lines.x, lines.y), 1.0);
+    if(d < 0.0 || b >= 0.0 || abs(cell.y) > grid.y || alpha <= 0.0)
+        discard;
+
+    vec4 clip = MVP * vec4(hit, 1.0);
+    gl_FragDepth = 0.5 + 0.5 * clip.z / clip.w;
+    gl_FragColor = vec4(0.33, 0.34, 0.32, alpha);
 }
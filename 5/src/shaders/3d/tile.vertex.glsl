@@ -1,59 +1,77 @@
 #version 120
 #extension GL_EXT_gpu_shader4: enable
+#extension GL_EXT_texture_array: enable
+#extension GL_ARB_uniform_buffer_object: enable
 
-uniform vec4 box;
 uniform mat4 MVP;
+uniform int first;
 
-attribute float height;
+// Tile heights by layer
+uniform usampler2DArray heights;
 
-varying vec4 fragmentColor;
+// cos, sin of the latitude of row i and of the longitude of column i, a row per tile
+uniform sampler2D trig;
+
+// Box, (height layer, trig row, level), side levels (bottom, right, top, left)
+struct Instance
+{
+    vec4    box;
+    ivec4   data;
+    ivec4   edges;
+};
 
-/* PROJECTION */
-#define M_PI    3.14159265358979323846
-#define M_PI_2  1.57079632679489661923
+layout(std140) uniform Instances
+{
+    Instance instances[9];
+};
+
+attribute vec2 vertexPosition;
+
+varying vec4 fragmentColor;
 
 const float EQUATORIAL_RADIUS    = 6378137.0;
-const float POLAR_RADIUS         = 6356752.3142;
-const float RADIUS_RATIO         = POLAR_RADIUS / EQUATORIAL_RADIUS;
-const float ECCENT               = sqrt(1.0 - RADIUS_RATIO * RADIUS_RATIO);
-const float COM                  = 0.5 * ECCENT;
 
-float metToLon(float x)
+float sampleHeight(Instance tile, ivec2 grid)
 {
-    return 180.0 * x / EQUATORIAL_RADIUS / M_PI;
+    return float(texelFetch2DArray(heights, ivec3(grid, tile.data.x), 0).r);
 }
 
-float metToLat(float y)
+vec4 getVertex(Instance tile, ivec2 grid)
 {
-    float ts    = exp(-y / EQUATORIAL_RADIUS);
-    float phi   = M_PI_2 - 2.0 * atan(ts);
-    float dphi  = 1.0;
-    for(int i = 0; abs(dphi) > 0.000000001 && i < 15; ++ i)
-    {
-        float con = ECCENT * sin(phi);
-        dphi = M_PI_2 - 2.0 * atan(ts * pow((1.0 - con) / (1.0 + con), COM)) - phi;
-        phi += dphi;
-    }
-
-    return 180.0 * phi / M_PI;
+    float height = sampleHeight(tile, grid);
+    if(height == 32768.0)
+        height = 0.0;
+
+    float radius = EQUATORIAL_RADIUS + height - 1000.0;
+    vec2 lat = texelFetch2D(trig, ivec2(grid.y, tile.data.y), 0).xy;
+    vec2 lon = texelFetch2D(trig, ivec2(grid.x, tile.data.y), 0).zw;
+    return vec4(radius * lat.x * lon.x, radius * lat.x * lon.y, radius * lat.y, 1.0);
 }
 
 void main()
 {
-    int y = gl_VertexID / 1025;
-    int x = gl_VertexID - y * 1025;
-    vec4 vertex = vec4(x, y, height, 1);
-    vertex.x = box.x + (box.y - box.x) * vertex.x / 1024.0;
-    vertex.y = box.z + (box.w - box.z) * vertex.y / 1024.0;
-    if(vertex.z == 32768.0)
-        vertex.z = 0;
-
-    float altitude = vertex.z - 1000.0;
-    vec2 lonlat = vec2(metToLon(vertex.x) * M_PI / 180.0, metToLat(vertex.y) * M_PI / 180.0);
-    vertex.x = (EQUATORIAL_RADIUS + altitude) * cos(lonlat.y) * cos(lonlat.x);
-    vertex.y = (EQUATORIAL_RADIUS + altitude) * cos(lonlat.y) * sin(lonlat.x);
-    vertex.z = (EQUATORIAL_RADIUS + altitude) * sin(lonlat.y);
-    gl_Position = MVP * vertex;
+    Instance tile = instances[first + gl_InstanceID];
+    ivec2 grid = ivec2(vertexPosition);
+
+    // Side vertices between the samples of a coarser neighbour are moved onto its edge
+    int side = grid.y == 0 ? 0 : grid.x == 1024 ? 1 : grid.y == 1024 ? 2 : grid.x == 0 ? 3 : -1;
+    ivec2 other = grid;
+    float weight = 0.0;
+    if(side >= 0)
+    {
+        int step = 1 << tile.edges[side];
+        ivec2 along = side == 0 || side == 2 ? ivec2(1, 0) : ivec2(0, 1);
+        int offset = (along.x * grid.x + along.y * grid.y) % step;
+        if(offset > 0)
+        {
+            grid -= along * offset;
+            other = grid + along * step;
+            weight = float(offset) / float(step);
+        }
+    }
+
+    float height = mix(sampleHeight(tile, grid), sampleHeight(tile, other), weight);
+    gl_Position = MVP * mix(getVertex(tile, grid), getVertex(tile, other), weight);
 
     float ht = height - 1000.0;
     if(ht < 0.0)